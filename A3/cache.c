@@ -0,0 +1,286 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raid.h"
+
+/*
+ * This file implements the controller's block cache. It holds copies of
+ * the blocks stored on the disks, keyed by disk and stripe, so data and
+ * parity blocks are cached alike. When the cache is full, the least
+ * recently used block is replaced.
+ */
+
+// One cached block. Entries are linked into a hash chain for lookup and
+// into a list ordered by last use; links are indices into entries, -1
+// ends a list.
+typedef struct
+{
+    int disk_num;
+    int stripe_num; // -1 if the entry is unused
+    int prefetched; // read ahead and not used since
+    int hash_next;
+    int lru_prev; // towards the most recently used
+    int lru_next; // towards the least recently used
+} cache_entry_t;
+
+static cache_entry_t *entries;
+static char *blocks; // capacity blocks of block_size bytes, one per entry
+static int *buckets;
+static int capacity;
+static unsigned int bucket_mask;
+static int most_recent = -1;
+static int least_recent = -1;
+
+static cache_stats_t stats;
+
+/* Return the hash bucket for the block at stripe_num on disk_num.
+ */
+static unsigned int bucket_of(int disk_num, int stripe_num)
+{
+    return ((unsigned int)stripe_num * (num_disks + 1) + disk_num) & bucket_mask;
+}
+
+/* Remove entry e from the list ordered by last use.
+ */
+static void lru_unlink(int e)
+{
+    if (entries[e].lru_prev >= 0)
+    {
+        entries[entries[e].lru_prev].lru_next = entries[e].lru_next;
+    }
+    else
+    {
+        most_recent = entries[e].lru_next;
+    }
+
+    if (entries[e].lru_next >= 0)
+    {
+        entries[entries[e].lru_next].lru_prev = entries[e].lru_prev;
+    }
+    else
+    {
+        least_recent = entries[e].lru_prev;
+    }
+}
+
+/* Put entry e at the most recently used end of the list.
+ */
+static void lru_push(int e)
+{
+    entries[e].lru_prev = -1;
+    entries[e].lru_next = most_recent;
+    if (most_recent >= 0)
+    {
+        entries[most_recent].lru_prev = e;
+    }
+    most_recent = e;
+    if (least_recent < 0)
+    {
+        least_recent = e;
+    }
+}
+
+/* Remove entry e from its hash chain.
+ */
+static void hash_unlink(int e)
+{
+    int *link = &buckets[bucket_of(entries[e].disk_num, entries[e].stripe_num)];
+    while (*link != e)
+    {
+        link = &entries[*link].hash_next;
+    }
+    *link = entries[e].hash_next;
+}
+
+/* Return the entry holding the block at stripe_num on disk_num, or -1
+ * if it is not cached.
+ */
+static int find(int disk_num, int stripe_num)
+{
+    if (capacity == 0)
+    {
+        return -1;
+    }
+
+    int e = buckets[bucket_of(disk_num, stripe_num)];
+    while (e >= 0 && (entries[e].disk_num != disk_num || entries[e].stripe_num != stripe_num))
+    {
+        e = entries[e].hash_next;
+    }
+    return e;
+}
+
+/* Allocate a cache that holds up to size blocks. A size of 0 disables
+ * the cache.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int cache_init(int size)
+{
+    capacity = size;
+    if (capacity == 0)
+    {
+        return 0;
+    }
+
+    // at least two buckets per entry keeps the chains short
+    unsigned int nbuckets = 1;
+    while (nbuckets < 2 * (unsigned int)capacity)
+    {
+        nbuckets *= 2;
+    }
+    bucket_mask = nbuckets - 1;
+
+    entries = malloc(capacity * sizeof(*entries));
+    blocks = malloc((size_t)capacity * block_size);
+    buckets = malloc(nbuckets * sizeof(*buckets));
+    if (!entries || !blocks || !buckets)
+    {
+        perror("Failed to allocate block cache");
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < nbuckets; i++)
+    {
+        buckets[i] = -1;
+    }
+    // every entry starts unused, in the list so that it is taken first
+    for (int e = 0; e < capacity; e++)
+    {
+        entries[e].stripe_num = -1;
+        entries[e].hash_next = -1;
+        lru_push(e);
+    }
+    return 0;
+}
+
+/* Return 1 if the block at stripe_num on disk_num is cached, without
+ * counting it as a use.
+ */
+int cache_contains(int disk_num, int stripe_num)
+{
+    return find(disk_num, stripe_num) >= 0;
+}
+
+/* Look up the block at stripe_num on disk_num and copy it into data if
+ * it is cached.
+ *
+ * Returns 0 on a hit and -1 on a miss.
+ */
+int cache_lookup(int disk_num, int stripe_num, char *data)
+{
+    if (capacity == 0)
+    {
+        return -1;
+    }
+
+    int e = find(disk_num, stripe_num);
+    if (e < 0)
+    {
+        stats.misses++;
+        return -1;
+    }
+
+    stats.hits++;
+    if (entries[e].prefetched)
+    {
+        stats.prefetch_hits++;
+        entries[e].prefetched = 0;
+    }
+
+    lru_unlink(e);
+    lru_push(e);
+    memcpy(data, &blocks[(size_t)e * block_size], block_size);
+    return 0;
+}
+
+/* Store a copy of data as the block at stripe_num on disk_num, replacing
+ * the least recently used block if the cache is full. prefetched is 1 if
+ * the block was read ahead rather than asked for.
+ */
+void cache_store(int disk_num, int stripe_num, const char *data, int prefetched)
+{
+    if (capacity == 0)
+    {
+        return;
+    }
+
+    int e = find(disk_num, stripe_num);
+    if (e < 0)
+    {
+        e = least_recent;
+        if (entries[e].stripe_num >= 0)
+        {
+            hash_unlink(e);
+            stats.evictions++;
+        }
+
+        entries[e].disk_num = disk_num;
+        entries[e].stripe_num = stripe_num;
+        unsigned int b = bucket_of(disk_num, stripe_num);
+        entries[e].hash_next = buckets[b];
+        buckets[b] = e;
+
+        entries[e].prefetched = prefetched;
+        if (prefetched)
+        {
+            stats.prefetched++;
+        }
+    }
+    else
+    {
+        entries[e].prefetched = 0;
+    }
+
+    lru_unlink(e);
+    lru_push(e);
+    memcpy(&blocks[(size_t)e * block_size], data, block_size);
+}
+
+/* Drop the block at stripe_num on disk_num from the cache, so that it is
+ * next read from the disk.
+ */
+void cache_invalidate(int disk_num, int stripe_num)
+{
+    int e = find(disk_num, stripe_num);
+    if (e < 0)
+    {
+        return;
+    }
+
+    hash_unlink(e);
+    entries[e].stripe_num = -1;
+
+    // an unused entry is the first to be replaced
+    lru_unlink(e);
+    entries[e].lru_next = -1;
+    entries[e].lru_prev = least_recent;
+    if (least_recent >= 0)
+    {
+        entries[least_recent].lru_next = e;
+    }
+    least_recent = e;
+    if (most_recent < 0)
+    {
+        most_recent = e;
+    }
+}
+
+/* Return the cache's counters.
+ */
+cache_stats_t cache_stats()
+{
+    return stats;
+}
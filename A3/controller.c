@@ -10,12 +10,21 @@
  * All of the files in this directory and all subdirectories are:
  * Copyright (c) 2025 Karen Reid
  */
+#define _GNU_SOURCE // for ppoll
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include "raid.h"
 
 /*
@@ -26,8 +35,167 @@
  */
 
 // Global array to store information about each disk's communication pipes.
+// The entries after the disks, from num_disks + 1 on, are the hot spares:
+// idle disk processes that take over from a failed disk in restart_disk.
+// A spare's entry is failed while it has no process.
 static disk_controller_t *controllers;
 
+int transport = TRANSPORT_PIPE;
+int warm_start = 0;
+int queue_depth = DEFAULT_QUEUE_DEPTH;
+int cache_blocks = DEFAULT_CACHE_BLOCKS;
+int writeback_stripes = DEFAULT_WRITEBACK_STRIPES;
+int rebuild_rate = DEFAULT_REBUILD_RATE;
+int spare_disks = DEFAULT_SPARE_DISKS;
+int scrub_rate = DEFAULT_SCRUB_RATE;
+double hedge_percentile = DEFAULT_HEDGE_PERCENTILE;
+
+// The array superblock, saved in SUPERBLOCK_FILE next to the disk images.
+// It records the geometry the images were written with and a generation
+// counter that is bumped every time the array is started. It is followed
+// in the file by one generation number per disk: the generation in which
+// that disk's image was last checkpointed completely.
+#define SUPERBLOCK_FILE "raid.sb"
+#define SUPERBLOCK_MAGIC 0x52414944 // "RAID"
+#define SUPERBLOCK_VERSION 1
+
+typedef struct {
+    unsigned int magic;
+    int version;
+    int num_disks;
+    int block_size;
+    int disk_size;
+    int raid_level;
+    unsigned int generation;
+} superblock_t;
+
+static superblock_t superblock;
+static unsigned int *disk_generation;
+
+// image_valid[i] is 1 if disk i's image file is a consistent older copy
+// of the disk. Together with the disk's write-intent bitmap it lets a
+// restarted disk load the image and rebuild only the stripes that have
+// been written since the image was saved.
+static int *image_valid;
+
+// Write-intent bitmaps, one bit per stripe for each disk. A bit is set
+// (and saved to the disk's BITMAP_FILE) before a write is sent to that
+// stripe of the disk, and the whole bitmap is cleared once the disk has
+// checkpointed its image.
+#define BITMAP_FILE "disk_%d.bitmap"
+
+typedef struct {
+    unsigned int base_generation; // disk_generation of the image the bits apply to
+    int stripes;
+} bitmap_header_t;
+
+static unsigned char **intent;
+static int *intent_fd;
+
+// Set when this run started from the saved images rather than empty disks
+static int images_reused;
+
+// Read-ahead for sequential readers: when read_block sees consecutive
+// block numbers, the next stripe is read from every disk into the block
+// cache. The reads complete in the background and are collected by
+// finish_prefetch before the disks are used again.
+static disk_io_t *prefetch_ios; // num_disks + 1 reads, one per disk
+static char *prefetch_data;     // a block for each read
+static int prefetch_count;      // reads submitted and not yet collected
+static int prefetch_stripe = -1; // last stripe read ahead
+static int last_read_block = -1;
+
+// Write-back buffer: with writeback_stripes > 0, write_block copies the
+// block into the buffer entry for its stripe and returns. A stripe is
+// written to the disks with a single parity update when all of its data
+// blocks are buffered, when its entry is needed for another stripe, when
+// it has been buffered for WRITEBACK_DELAY_MS, and on flush_writeback.
+#define WRITEBACK_DELAY_MS 200
+
+typedef struct {
+    int stripe_num;         // -1 if the entry is unused
+    int count;              // number of data blocks buffered
+    unsigned char *present; // present[i] is 1 if data block i of the stripe is buffered
+    char *data;             // num_disks blocks
+    struct timespec since;  // when the first block was buffered
+} writeback_t;
+
+static writeback_t *writeback;
+static writeback_stats_t writeback_counts;
+
+// Parity blocks of the full stripes that write_stripe_blocks has in
+// flight at once, queue_depth of them
+static char *stripe_parity;
+
+// Old data blocks read by access_blocks for the writes in a batch, which
+// become the changes to their parity, one for each of up to queue_depth
+// writes
+static char *access_data;
+
+// Hedged reads: with hedge_percentile > 0, a read that its disk has not
+// answered by the deadline is raced against reconstructing the block from
+// the rest of its stripe, and whichever finishes first is used. The
+// deadline is that percentile of the read latency of the fastest disk,
+// recomputed every HEDGE_REFRESH reads once it is known. The requests
+// that lose are abandoned: each is replaced by a copy in its disk's
+// orphans, and its reply is read into abandoned_data and discarded.
+// Until a disk has answered all of its abandoned reads, it is known to
+// be behind, and its blocks are read by reconstruction rather than
+// queued behind them.
+#define HEDGE_REFRESH 256
+
+static uint64_t hedge_deadline;    // nanoseconds, 0 until enough reads have been seen
+static unsigned long hedge_reads;  // reads since the deadline was recomputed
+static hedge_stats_t hedge_counts;
+static char *abandoned_data;       // a block
+
+// A disk that has failed but not been restored yet, or -1. While a disk
+// is degraded, its blocks are read by reconstructing them from the other
+// disks; it is restored from controller_idle, or before anything is
+// written while it is still degraded.
+static int degraded_disk = -1;
+
+// A restored disk that is being rebuilt, or -1. The stripes below the
+// watermark have been rebuilt; reads of the stripes above it that are
+// out of date are reconstructed from the other disks, like reads of a
+// degraded disk. The rebuild proceeds in batches of REBUILD_BATCH stripes
+// from controller_idle, at up to rebuild_rate stripes per second.
+#define REBUILD_BATCH 8
+
+static int rebuilding_disk = -1;
+static int rebuild_watermark;
+static long rebuild_count;               // stripes rebuilt since the rebuild started
+static struct timespec rebuild_started;
+static char *rebuild_data;              // REBUILD_BATCH stripes of num_disks + 1 blocks
+
+// The supervisor: an epoll set holding a pidfd for every disk and spare
+// process, so that a disk is known to have failed as soon as its process
+// exits, rather than when a request to it next fails. It is -1 if pidfds
+// are not available, and failures are then found on the next request.
+static int supervisor = -1;
+
+// Background scrub: with scrub_rate > 0, controller_idle reads up to
+// scrub_rate stripes per second from every disk, in batches of
+// SCRUB_BATCH stripes, going round the array continuously. A block that
+// fails its checksum is rebuilt from the other disks, and a stripe whose
+// blocks do not XOR to zero gets its parity block rewritten from its data.
+// The scrub waits while a disk is degraded or being rebuilt.
+#define SCRUB_BATCH 8
+
+static int scrub_cursor;                // next stripe to check
+static long scrub_count;                // stripes checked or passed over since scrub_started
+static struct timespec scrub_started;
+static char *scrub_data;                // SCRUB_BATCH stripes of num_disks + 1 blocks, and one more
+static scrub_stats_t scrub_counts;
+
+static void start_rebuild(int disk_num);                           // forward declaration
+static void finish_rebuild();                                      // forward declaration
+static void rebuild_stripes(int count);                            // forward declaration
+static void scrub_stripes(int count);                              // forward declaration
+static int buffer_block(int block_num, char *data);                // forward declaration
+static int do_units(disk_io_t *ios, int n);                        // forward declaration
+static int repair_unit(int disk_num, int stripe_num, char *data); // forward declaration
+
 /* Ignoring SIGPIPE allows us to check write calls for error rather than
  * terminating the whole system.
  */
@@ -43,8 +211,392 @@ static void ignore_sigpipe()
     }
 }
 
+/* Return the size in bytes of the shared region for one disk.
+ */
+static size_t shm_size()
+{
+    return (size_t)queue_depth * block_size;
+}
+
+/* Reset the request tracking of the num-th disk and map a fresh shared
+ * payload region for it if the shared memory transport is in use. The
+ * region is inherited by the disk process when it is forked.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int map_disk_shm(int num)
+{
+    controllers[num].shm = NULL;
+    controllers[num].outstanding = 0;
+    controllers[num].abandoned = 0;
+    controllers[num].failed = 0;
+    memset(controllers[num].inflight, 0, queue_depth * sizeof(disk_io_t *));
+
+    if (transport != TRANSPORT_SHM)
+    {
+        return 0;
+    }
+
+    void *region = mmap(NULL, shm_size(), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        perror("Failed to map shared memory for disk");
+        return -1;
+    }
+
+    controllers[num].shm = region;
+    return 0;
+}
+
+/* Close the parent's ends of the pipes of the num-th entry and unmap its
+ * shared region, once its process has gone.
+ */
+static void close_disk(int num)
+{
+    close(controllers[num].to_disk[1]);   // Write end used by parent
+    close(controllers[num].from_disk[0]); // Read end used by parent
+
+    // The dead disk may still have been using the old shared region,
+    // so the new disk gets a fresh one
+    if (controllers[num].shm)
+    {
+        munmap(controllers[num].shm, shm_size());
+        controllers[num].shm = NULL;
+    }
+}
+
+/* Start supervising process pid by adding a pidfd for it to the
+ * supervisor's set.
+ *
+ * Returns the pidfd, or -1 if the process cannot be supervised.
+ */
+static int watch_process(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    if (supervisor < 0)
+    {
+        return -1;
+    }
+
+    int fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct epoll_event ev = {EPOLLIN, {.fd = fd}};
+    if (epoll_ctl(supervisor, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+/* Reap the process of the num-th entry, which has exited or is being
+ * given up on, and stop supervising it. An unsupervised process is left
+ * to whoever killed it.
+ */
+static void reap_disk(int num)
+{
+    disk_controller_t *dc = &controllers[num];
+    if (dc->pidfd < 0)
+    {
+        return;
+    }
+
+    // a disk that failed without exiting is not going to be used again
+    kill(dc->pid, SIGKILL);
+    waitpid(dc->pid, NULL, 0);
+
+    epoll_ctl(supervisor, EPOLL_CTL_DEL, dc->pidfd, NULL);
+    close(dc->pidfd);
+    dc->pidfd = -1;
+}
+
+/* Write the superblock and the per-disk generations to SUPERBLOCK_FILE.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int save_superblock()
+{
+    FILE *fp = fopen(SUPERBLOCK_FILE, "wb");
+    if (!fp)
+    {
+        perror("Failed to create superblock");
+        return -1;
+    }
+
+    if (fwrite(&superblock, sizeof(superblock), 1, fp) != 1 ||
+        fwrite(disk_generation, sizeof(*disk_generation), num_disks + 1, fp) != (size_t)num_disks + 1)
+    {
+        fprintf(stderr, "Error: Failed to write superblock\n");
+        fclose(fp);
+        return -1;
+    }
+
+    if (fclose(fp) != 0)
+    {
+        perror("Failed to close superblock");
+        return -1;
+    }
+    return 0;
+}
+
+/* Return the number of bytes in one disk's write-intent bitmap.
+ */
+static size_t bitmap_bytes()
+{
+    return (disk_size / block_size + 7) / 8;
+}
+
+/* Return 1 if stripe is marked in disk_num's write-intent bitmap.
+ */
+static int stripe_dirty(int disk_num, int stripe)
+{
+    return (intent[disk_num][stripe / 8] >> (stripe % 8)) & 1;
+}
+
+/* Mark stripe in disk_num's write-intent bitmap. The first time a stripe
+ * is marked, the changed byte is written to the bitmap file before the
+ * caller goes on to send the write.
+ */
+static void mark_intent(int disk_num, int stripe)
+{
+    unsigned char *byte = &intent[disk_num][stripe / 8];
+    unsigned char bit = 1 << (stripe % 8);
+
+    if (*byte & bit)
+    {
+        return;
+    }
+    *byte |= bit;
+
+    off_t offset = sizeof(bitmap_header_t) + stripe / 8;
+    if (intent_fd[disk_num] >= 0 && pwrite(intent_fd[disk_num], byte, 1, offset) != 1)
+    {
+        perror("Failed to update write-intent bitmap");
+    }
+}
+
+/* Clear disk_num's write-intent bitmap because its image now matches
+ * generation base_generation, and save the empty bitmap.
+ */
+static void reset_intent(int disk_num, unsigned int base_generation)
+{
+    memset(intent[disk_num], 0, bitmap_bytes());
+
+    bitmap_header_t header = {base_generation, disk_size / block_size};
+    if (intent_fd[disk_num] >= 0 &&
+        (pwrite(intent_fd[disk_num], &header, sizeof(header), 0) != sizeof(header) ||
+         pwrite(intent_fd[disk_num], intent[disk_num], bitmap_bytes(), sizeof(header)) != (ssize_t)bitmap_bytes()))
+    {
+        perror("Failed to save write-intent bitmap");
+    }
+}
+
+/* Open disk_num's bitmap file, creating it if needed. If load is set,
+ * read the saved bits into memory, provided they apply to the disk's
+ * current image.
+ *
+ * Returns 0 if the bits were loaded and -1 otherwise.
+ */
+static int open_intent(int disk_num, int load)
+{
+    char name[MAX_NAME];
+    snprintf(name, sizeof(name), BITMAP_FILE, disk_num);
+
+    intent_fd[disk_num] = open(name, O_RDWR | O_CREAT, 0644);
+    if (intent_fd[disk_num] < 0)
+    {
+        perror("Failed to open write-intent bitmap");
+        return -1;
+    }
+
+    if (!load)
+    {
+        return -1;
+    }
+
+    bitmap_header_t header;
+    if (pread(intent_fd[disk_num], &header, sizeof(header), 0) != sizeof(header) ||
+        header.base_generation != disk_generation[disk_num] ||
+        header.stripes != disk_size / block_size ||
+        pread(intent_fd[disk_num], intent[disk_num], bitmap_bytes(), sizeof(header)) != (ssize_t)bitmap_bytes())
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Return the number of stripes marked in disk_num's write-intent bitmap.
+ */
+static int count_dirty(int disk_num)
+{
+    int count = 0;
+    for (int stripe = 0; stripe < disk_size / block_size; stripe++)
+    {
+        count += stripe_dirty(disk_num, stripe);
+    }
+    return count;
+}
+
+/* Return 1 if disk num's image file exists and is exactly disk_size
+ * bytes long, and 0 otherwise.
+ */
+static int image_usable(int num)
+{
+    char disk_name[MAX_NAME];
+    snprintf(disk_name, sizeof(disk_name), "disk_%d.dat", num);
+
+    struct stat st;
+    return stat(disk_name, &st) == 0 && st.st_size == disk_size;
+}
+
+/* Read SUPERBLOCK_FILE and decide which disk images can be reused.
+ * An image is reused only if the superblock matches the configured
+ * geometry and the disk's write-intent bitmap was saved for the image's
+ * generation. Images checkpointed at the last clean shutdown have an
+ * empty bitmap; an older image has the stripes written since it was
+ * saved marked.
+ *
+ * Sets image_valid for every reusable image and returns the number
+ * of disks whose image is missing or has stripes marked.
+ */
+static int load_superblock()
+{
+    superblock_t old;
+    unsigned int old_generation[num_disks + 1];
+
+    FILE *fp = fopen(SUPERBLOCK_FILE, "rb");
+    if (!fp)
+    {
+        return num_disks + 1;
+    }
+
+    int ok = fread(&old, sizeof(old), 1, fp) == 1 &&
+             fread(old_generation, sizeof(*old_generation), num_disks + 1, fp) == (size_t)num_disks + 1;
+    fclose(fp);
+
+    if (!ok || old.magic != SUPERBLOCK_MAGIC || old.version != SUPERBLOCK_VERSION ||
+        old.num_disks != num_disks || old.block_size != block_size ||
+        old.disk_size != disk_size || old.raid_level != raid_level)
+    {
+        fprintf(stderr, "Warning: %s does not match this array, starting with empty disks\n", SUPERBLOCK_FILE);
+        return num_disks + 1;
+    }
+
+    int stale = 0;
+    for (int i = 0; i < num_disks + 1; i++)
+    {
+        disk_generation[i] = old_generation[i];
+        image_valid[i] = open_intent(i, 1) == 0 && image_usable(i);
+        if (!image_valid[i] || count_dirty(i) > 0)
+        {
+            stale++;
+        }
+    }
+    superblock.generation = old.generation;
+
+    return stale;
+}
+
+/* Set up the superblock for this run of the array, reusing the disk
+ * images from the previous run if warm_start is set and they are valid.
+ *
+ * Otherwise every image file is truncated to an empty disk, which is
+ * what the disks start with, so the write-intent bitmaps describe how
+ * far each disk has moved from its image from the start.
+ *
+ * Returns the number of the single disk that has to be (partly) rebuilt
+ * from the others, or -1 if every disk loads a current image or starts
+ * empty.
+ */
+static int open_array()
+{
+    superblock.magic = SUPERBLOCK_MAGIC;
+    superblock.version = SUPERBLOCK_VERSION;
+    superblock.num_disks = num_disks;
+    superblock.block_size = block_size;
+    superblock.disk_size = disk_size;
+    superblock.raid_level = raid_level;
+    superblock.generation = 0;
+
+    int stale = num_disks + 1;
+    if (warm_start)
+    {
+        stale = load_superblock();
+    }
+
+    // Parity can recover one out of date image. With more than that the
+    // images cannot be combined into a consistent array.
+    int rebuild = -1;
+    if (stale == 1)
+    {
+        for (int i = 0; i < num_disks + 1; i++)
+        {
+            if (!image_valid[i] || count_dirty(i) > 0)
+            {
+                rebuild = i;
+            }
+        }
+    }
+    else if (stale > 1)
+    {
+        if (warm_start && stale < num_disks + 1)
+        {
+            fprintf(stderr, "Warning: %d disk images are stale, starting with empty disks\n", stale);
+        }
+
+        superblock.generation = 0;
+        for (int i = 0; i < num_disks + 1; i++)
+        {
+            char disk_name[MAX_NAME];
+            snprintf(disk_name, sizeof(disk_name), "disk_%d.dat", i);
+
+            image_valid[i] = truncate(disk_name, 0) == 0 && truncate(disk_name, disk_size) == 0;
+            if (!image_valid[i])
+            {
+                // the image does not exist yet
+                int fd = open(disk_name, O_WRONLY | O_CREAT, 0644);
+                image_valid[i] = fd >= 0 && ftruncate(fd, disk_size) == 0;
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+            }
+
+            disk_generation[i] = 0;
+            if (intent_fd[i] < 0)
+            {
+                open_intent(i, 0);
+            }
+            reset_intent(i, 0);
+        }
+    }
+
+    images_reused = stale <= 1;
+    if (debug && images_reused)
+    {
+        fprintf(stderr, "Reusing disk images from generation %u\n", superblock.generation);
+    }
+
+    // Until this run shuts down cleanly, no image belongs to the new
+    // generation
+    superblock.generation++;
+    save_superblock();
+
+    return rebuild;
+}
+
 /* Initialize the num-th disk controller, creating pipes to communicate
- * and creating a child process to handle disk requests.
+ * and creating a child process to handle disk requests. An entry past the
+ * disks gets a hot spare process instead.
  *
  * Returns 0 on success and -1 on failure.
  */
@@ -67,6 +619,15 @@ static int init_disk(int num)
         return -1;
     }
 
+    if (map_disk_shm(num) != 0)
+    {
+        close(controllers[num].to_disk[0]);
+        close(controllers[num].to_disk[1]);
+        close(controllers[num].from_disk[0]);
+        close(controllers[num].from_disk[1]);
+        return -1;
+    }
+
     pid_t pid = fork();
 
     // if its not the child process
@@ -88,22 +649,78 @@ static int init_disk(int num)
         close(controllers[num].to_disk[1]); // Close write end of to_disk
         // (read end of parent process)
         close(controllers[num].from_disk[0]); // Close read end of from_disk
+        trace_forked();
 
         // Run the disk simulation
         // The child never returns from this function
-        start_disk(num, controllers[num].from_disk[1], controllers[num].to_disk[0]);
-        exit(1); // this code shouldn't run right?
+        if (num > num_disks)
+        {
+            exit(start_spare(controllers[num].from_disk[1], controllers[num].to_disk[0],
+                             controllers[num].shm));
+        }
+        exit(start_disk(num, controllers[num].from_disk[1], controllers[num].to_disk[0],
+                        controllers[num].shm, images_reused && image_valid[num]));
     }
 
     controllers[num].pid = pid;
+    controllers[num].pidfd = watch_process(pid);
 
     close(controllers[num].to_disk[0]);   // Close read end of to_disk
     close(controllers[num].from_disk[1]); // Close write end of from_disk
 
+    // Requests are written without blocking, so that replies can be
+    // collected while the pipe to the disk is full (see send_all)
+    fcntl(controllers[num].to_disk[1], F_SETFL, O_NONBLOCK);
+
     return 0;
 }
 
+/* Promote a hot spare into the place of the num-th disk, whose process
+ * has gone and whose pipe ends have been closed. The two entries swap, so
+ * the spare's pipes and shared region now belong to disk num, and the
+ * spare is told which disk it has become. The spare's old entry is left
+ * failed until controller_idle starts a new spare in it.
+ *
+ * Returns 0 on success and -1 if no spare could take over.
+ */
+static int promote_spare(int num)
+{
+    int spare = num_disks + 1;
+    while (spare < num_disks + 1 + spare_disks && controllers[spare].failed)
+    {
+        spare++;
+    }
+    if (spare == num_disks + 1 + spare_disks)
+    {
+        return -1;
+    }
+
+    disk_controller_t dead = controllers[num];
+    controllers[num] = controllers[spare];
+    controllers[spare] = dead;
+    controllers[spare].failed = 1;
+
+    // the spare needs to know whether to load the disk's image
+    int load_image = image_valid[num];
+    disk_io_t io = {num, CMD_ASSIGN, num, (char *)&load_image, 0, 0};
+    disk_submit(&io);
+    if (disk_complete(&io) == 0)
+    {
+        return 0;
+    }
+
+    // The spare is of no use, so it is discarded and the disk is
+    // restarted with a new process instead
+    fprintf(stderr, "Warning: Spare failed to take over disk %d\n", num);
+    reap_disk(num);
+    close_disk(num);
+    return -1;
+}
+
 /* Restart the num-th disk, whose process is assumed to have already been killed.
+ * If the disk's image file is a valid older copy, the new process loads it.
+ * A hot spare takes over if one is ready, so that the disk is back without
+ * waiting for a fork and for the new process to allocate its memory.
  *
  * This function is very similar to init_disk.
  * However, since the other processes have all been started,
@@ -116,10 +733,20 @@ int restart_disk(int num)
 {
     ignore_sigpipe();
 
+    if (image_valid[num] && !image_usable(num))
+    {
+        image_valid[num] = 0;
+    }
+
     // Close the old pipe ends that the parent was using
     // (we'll create new ones)
-    close(controllers[num].to_disk[1]);   // Write end used by parent
-    close(controllers[num].from_disk[0]); // Read end used by parent
+    reap_disk(num);
+    close_disk(num);
+
+    if (promote_spare(num) == 0)
+    {
+        return 0;
+    }
 
     // Create new pipes for communication
     if (pipe(controllers[num].to_disk) < 0)
@@ -136,6 +763,15 @@ int restart_disk(int num)
         return -1;
     }
 
+    if (map_disk_shm(num) != 0)
+    {
+        close(controllers[num].to_disk[0]);
+        close(controllers[num].to_disk[1]);
+        close(controllers[num].from_disk[0]);
+        close(controllers[num].from_disk[1]);
+        return -1;
+    }
+
     pid_t pid = fork();
 
     // If fork failed
@@ -156,40 +792,119 @@ int restart_disk(int num)
         // Close unused pipe ends
         close(controllers[num].to_disk[1]);   // Close write end of to_disk
         close(controllers[num].from_disk[0]); // Close read end of from_disk
+        trace_forked();
 
         // Run the disk simulation
-        start_disk(num, controllers[num].from_disk[1], controllers[num].to_disk[0]);
-        exit(1); // Should not reach here
+        exit(start_disk(num, controllers[num].from_disk[1], controllers[num].to_disk[0],
+                        controllers[num].shm, image_valid[num]));
     }
 
     // In parent process
     controllers[num].pid = pid;
+    controllers[num].pidfd = watch_process(pid);
 
     close(controllers[num].to_disk[0]);   // Close read end of to_disk
     close(controllers[num].from_disk[1]); // Close write end of from_disk
 
+    // Requests are written without blocking, so that replies can be
+    // collected while the pipe to the disk is full (see send_all)
+    fcntl(controllers[num].to_disk[1], F_SETFL, O_NONBLOCK);
+
     return 0;
 }
 
 /* Initialize all disk controllers by initializing the controllers
  * array and calling init_disk for each disk.
  *
+ * If warm_start is set and the superblock matches this array, the disks
+ * load their saved images, and a single stale or missing image is
+ * rebuilt from the others.
+ *
  * total_disks is the number of data disks + 1 for the parity disk.
  *
  * Returns 0 on success and -1 on failure.
  */
 int init_all_controllers(int total_disks)
 {
-    // TODO: Complete this function
-
-    // Allocate memory for controllers on the heap
-    controllers = malloc(total_disks * sizeof(disk_controller_t));
-    if (!controllers)
+    // Allocate memory for controllers on the heap, with the hot spares
+    // after the disks
+    controllers = malloc((total_disks + spare_disks) * sizeof(disk_controller_t));
+    disk_generation = calloc(total_disks, sizeof(*disk_generation));
+    image_valid = calloc(total_disks, sizeof(*image_valid));
+    intent = malloc(total_disks * sizeof(*intent));
+    intent_fd = malloc(total_disks * sizeof(*intent_fd));
+    if (!controllers || !disk_generation || !image_valid || !intent || !intent_fd ||
+        stats_init(total_disks) != 0)
     {
         perror("Failed to allocate memory for controllers");
         return -1;
     }
 
+    for (int i = 0; i < total_disks; i++)
+    {
+        intent[i] = calloc(bitmap_bytes(), 1);
+        intent_fd[i] = -1;
+        controllers[i].inflight = calloc(queue_depth, sizeof(disk_io_t *));
+        controllers[i].issued = calloc(queue_depth, sizeof(uint64_t));
+        controllers[i].orphans = calloc(queue_depth, sizeof(disk_io_t));
+        controllers[i].pidfd = -1;
+        if (!intent[i] || !controllers[i].inflight || !controllers[i].issued || !controllers[i].orphans)
+        {
+            perror("Failed to allocate write-intent bitmap");
+            return -1;
+        }
+    }
+    for (int i = total_disks; i < total_disks + spare_disks; i++)
+    {
+        controllers[i].inflight = calloc(queue_depth, sizeof(disk_io_t *));
+        controllers[i].issued = calloc(queue_depth, sizeof(uint64_t));
+        controllers[i].orphans = calloc(queue_depth, sizeof(disk_io_t));
+        controllers[i].pidfd = -1;
+        if (!controllers[i].inflight || !controllers[i].issued || !controllers[i].orphans)
+        {
+            perror("Failed to allocate memory for controllers");
+            return -1;
+        }
+    }
+
+    writeback = malloc(writeback_stripes * sizeof(*writeback));
+    if (writeback_stripes > 0 && !writeback)
+    {
+        perror("Failed to allocate write-back buffer");
+        return -1;
+    }
+    for (int i = 0; i < writeback_stripes; i++)
+    {
+        writeback[i].stripe_num = -1;
+        writeback[i].present = malloc(num_disks);
+        writeback[i].data = malloc((size_t)num_disks * block_size);
+        if (!writeback[i].present || !writeback[i].data)
+        {
+            perror("Failed to allocate write-back buffer");
+            return -1;
+        }
+    }
+
+    rebuild_data = malloc((size_t)REBUILD_BATCH * total_disks * block_size);
+    scrub_data = malloc(((size_t)SCRUB_BATCH * total_disks + 1) * block_size);
+    stripe_parity = malloc((size_t)queue_depth * block_size);
+    access_data = malloc((size_t)queue_depth * block_size);
+    abandoned_data = malloc(block_size);
+    prefetch_ios = malloc(total_disks * sizeof(*prefetch_ios));
+    prefetch_data = malloc((size_t)total_disks * block_size);
+    if (!rebuild_data || !scrub_data || !stripe_parity || !access_data || !abandoned_data || !prefetch_ios || !prefetch_data ||
+        cache_init(cache_blocks) != 0)
+    {
+        perror("Failed to allocate block cache");
+        return -1;
+    }
+
+    // Decide which disk images are reused before the disks are started
+    int rebuild = open_array();
+
+    supervisor = epoll_create1(EPOLL_CLOEXEC);
+    clock_gettime(CLOCK_MONOTONIC, &scrub_started);
+
     for (int i = 0; i < total_disks; i++)
     {
         // if init disk returns an error
@@ -210,13 +925,848 @@ int init_all_controllers(int total_disks)
         }
     }
 
-    return 0;
-}
-
-/* Read the block of data at block_num from the appropriate disk.
- * The block is stored to the memory pointed to by data.
+    // A spare that cannot be started now is tried again by controller_idle
+    for (int i = total_disks; i < total_disks + spare_disks; i++)
+    {
+        if (init_disk(i) != 0)
+        {
+            controllers[i].failed = 1;
+        }
+    }
+
+    // One stale image can be brought up to date from the images of the others
+    if (rebuild >= 0)
+    {
+        fprintf(stderr, "Disk %d image is stale, rebuilding it\n", rebuild);
+        start_rebuild(rebuild);
+        if (rebuild_rate == 0)
+        {
+            finish_rebuild();
+        }
+    }
+
+    return 0;
+}
+
+/* Return the disk that holds the parity block of stripe stripe_num.
+ *
+ * RAID 4 keeps every parity block on the last disk. RAID 5 rotates the
+ * parity block one disk to the left on each stripe (the left-symmetric
+ * layout), so parity writes are spread over all num_disks + 1 disks.
+ */
+static int parity_disk(int stripe_num)
+{
+    if (raid_level == 5)
+    {
+        return num_disks - (stripe_num % (num_disks + 1));
+    }
+    return num_disks;
+}
+
+/* Return the disk that holds data block block_num.
+ *
+ * In RAID 5 the data blocks of a stripe start on the disk after the
+ * parity disk and wrap around, so consecutive blocks still land on
+ * different disks.
+ */
+static int data_disk(int block_num)
+{
+    int stripe_num = block_num / num_disks;
+    int index = block_num % num_disks;
+
+    if (raid_level == 5)
+    {
+        return (parity_disk(stripe_num) + 1 + index) % (num_disks + 1);
+    }
+    return index;
+}
+
+/* Return the shared slot that carries the payload of request tag on
+ * disk_num.
+ */
+static char *shm_slot(int disk_num, int tag)
+{
+    return &controllers[disk_num].shm[(size_t)tag * block_size];
+}
+
+/* Mark disk_num as failed and complete every request outstanding on it
+ * with status -1.
+ */
+static void fail_disk(int disk_num)
+{
+    disk_controller_t *dc = &controllers[disk_num];
+
+    trace_event(TRACE_FAIL, disk_num, -1, 0);
+    dc->failed = 1;
+    for (int tag = 0; tag < queue_depth; tag++)
+    {
+        if (dc->inflight[tag])
+        {
+            dc->inflight[tag]->status = -1;
+            dc->inflight[tag]->done = 1;
+            dc->inflight[tag] = NULL;
+        }
+    }
+    dc->outstanding = 0;
+    dc->abandoned = 0;
+}
+
+/* Make disk_num, which has just failed, the degraded disk if it can be:
+ * that is, if no other disk is degraded or being rebuilt.
+ */
+static void degrade_disk(int disk_num)
+{
+    if (degraded_disk < 0 && (rebuilding_disk < 0 || rebuilding_disk == disk_num))
+    {
+        fprintf(stderr, "Disk %d failed, reconstructing its blocks until it is rebuilt\n", disk_num);
+        degraded_disk = disk_num;
+        // the rebuild starts over once the disk is restored
+        rebuilding_disk = -1;
+    }
+}
+
+/* Handle the disk processes that have exited, waiting up to timeout_ms
+ * for one to do so, or indefinitely if timeout_ms is -1. A disk that has
+ * exited is failed at once, and becomes the degraded disk so that it is
+ * restored from controller_idle; if another disk is already down, its
+ * data is lost and restore_disk_process exits. A spare that has exited
+ * is replaced from controller_idle.
+ */
+static void watch_disks(int timeout_ms)
+{
+    struct epoll_event events[8];
+    int n = supervisor < 0 ? 0 : epoll_wait(supervisor, events, 8, timeout_ms);
+
+    for (int e = 0; e < n; e++)
+    {
+        int num = 0;
+        while (num < num_disks + 1 + spare_disks && controllers[num].pidfd != events[e].data.fd)
+        {
+            num++;
+        }
+        if (num == num_disks + 1 + spare_disks)
+        {
+            continue;
+        }
+
+        reap_disk(num);
+        if (num > num_disks)
+        {
+            close_disk(num);
+            controllers[num].failed = 1;
+            continue;
+        }
+
+        fail_disk(num);
+        degrade_disk(num);
+        if (degraded_disk != num)
+        {
+            restore_disk_process(num);
+        }
+    }
+}
+
+/* Return a descriptor that becomes readable when a disk process exits.
+ * A caller that waits in poll for the timeout returned by controller_idle
+ * can wait on this descriptor too, and call controller_idle again when it
+ * becomes readable, so that the failure is handled straight away.
+ *
+ * Returns the descriptor, or -1 if disk processes are not supervised.
+ */
+int controller_fd()
+{
+    return supervisor;
+}
+
+/* Read exactly size bytes from the pipe descriptor fd into buf.
+ *
+ * Returns 0 on success and -1 if the pipe was closed or the read failed.
+ */
+static int read_full(int fd, void *buf, size_t size)
+{
+    size_t total = 0;
+    while (total < size)
+    {
+        ssize_t n = read(fd, (char *)buf + total, size - total);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+/* Read one reply from disk_num and complete the request it belongs to.
+ * A disk writes each reply in one go, so once the header has arrived the
+ * rest of the reply can be read without waiting on anything else.
+ *
+ * Returns 0 on success and -1 if the disk has failed.
+ */
+static int receive_reply(int disk_num)
+{
+    disk_controller_t *dc = &controllers[disk_num];
+    disk_reply_t reply;
+
+    if (read_full(dc->from_disk[0], &reply, sizeof(reply)) != 0 ||
+        reply.tag >= (unsigned int)queue_depth || !dc->inflight[reply.tag])
+    {
+        fprintf(stderr, "Failed to read reply from disk %d\n", disk_num);
+        fail_disk(disk_num);
+        return -1;
+    }
+
+    disk_io_t *io = dc->inflight[reply.tag];
+    if (reply.length > 0)
+    {
+        // a block read through the pipe follows the header
+        if (reply.length != block_size || !io->data ||
+            read_full(dc->from_disk[0], io->data, block_size) != 0)
+        {
+            fprintf(stderr, "Failed to read data from disk %d\n", disk_num);
+            fail_disk(disk_num);
+            return -1;
+        }
+    }
+    else if (dc->shm && io->cmd == CMD_READ && reply.status == 0)
+    {
+        memcpy(io->data, shm_slot(disk_num, reply.tag), block_size);
+    }
+
+    if ((io->cmd == CMD_READ || io->cmd == CMD_WRITE || io->cmd == CMD_XOR_WRITE) &&
+        reply.status != STATUS_CANCELLED)
+    {
+        stats_disk(disk_num, io->cmd, stats_now() - dc->issued[reply.tag]);
+        trace_op_t op = io->cmd == CMD_READ ? TRACE_READ
+                      : io->cmd == CMD_WRITE ? TRACE_WRITE : TRACE_XOR_WRITE;
+        trace_event(op, disk_num, io->stripe_num, dc->issued[reply.tag]);
+    }
+    io->status = reply.status;
+    io->done = 1;
+    dc->inflight[reply.tag] = NULL;
+    dc->outstanding--;
+    dc->abandoned -= io == &dc->orphans[reply.tag];
+    return 0;
+}
+
+/* Write size bytes from buf to disk_num's request pipe.
+ *
+ * The pipe is non-blocking. When it is full, wait until the disk makes
+ * room, collecting the disk's replies in the meantime: the disk may
+ * itself be waiting for us to read a reply before it takes the next
+ * request, and blocking in write would deadlock both processes.
+ *
+ * Returns 0 on success and -1 if the disk has failed.
+ */
+static int send_all(int disk_num, const void *buf, size_t size)
+{
+    disk_controller_t *dc = &controllers[disk_num];
+    size_t sent = 0;
+
+    while (sent < size)
+    {
+        ssize_t n = write(dc->to_disk[1], (const char *)buf + sent, size - sent);
+        if (n > 0)
+        {
+            sent += n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            fprintf(stderr, "Failed to send request to disk %d\n", disk_num);
+            fail_disk(disk_num);
+            return -1;
+        }
+
+        struct pollfd fds[2] = {
+            {dc->to_disk[1], POLLOUT, 0},
+            {dc->from_disk[0], POLLIN, 0},
+        };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            return -1;
+        }
+        if ((fds[1].revents & (POLLIN | POLLHUP)) && receive_reply(disk_num) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Submit the request described by io to disk io->disk_num and return
+ * without waiting for it to complete. Up to queue_depth requests can be
+ * outstanding on each disk; beyond that, this waits for one of them to
+ * complete first. The buffer io->data must stay valid until the request
+ * completes, which is signalled by io->done being set.
+ *
+ * Returns 0 on success and -1 if the disk has failed, in which case the
+ * request is already complete with status -1.
+ */
+int disk_submit(disk_io_t *io)
+{
+    disk_controller_t *dc = &controllers[io->disk_num];
+
+    io->status = -1;
+    io->done = 0;
+
+    while (!dc->failed && dc->outstanding >= queue_depth)
+    {
+        receive_reply(io->disk_num);
+    }
+    if (dc->failed)
+    {
+        io->done = 1;
+        return -1;
+    }
+
+    int tag = 0;
+    while (dc->inflight[tag])
+    {
+        tag++;
+    }
+
+    // the disk's image file will no longer match this stripe
+    if (io->cmd == CMD_WRITE || io->cmd == CMD_XOR_WRITE)
+    {
+        mark_intent(io->disk_num, io->stripe_num);
+    }
+
+    disk_request_t req = {tag, io->cmd, io->stripe_num, 0};
+    if (io->cmd == CMD_WRITE || io->cmd == CMD_XOR_WRITE)
+    {
+        if (dc->shm)
+        {
+            memcpy(shm_slot(io->disk_num, tag), io->data, block_size);
+        }
+        else
+        {
+            req.length = block_size;
+        }
+    }
+    else if (io->cmd == CMD_ASSIGN)
+    {
+        // the load flag always travels through the pipe
+        req.length = sizeof(int);
+    }
+
+    dc->inflight[tag] = io;
+    dc->issued[tag] = stats_now();
+    dc->outstanding++;
+
+    if (send_all(io->disk_num, &req, sizeof(req)) != 0 ||
+        (req.length > 0 && send_all(io->disk_num, io->data, req.length) != 0))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Wait for the request io, which was passed to disk_submit, to complete.
+ *
+ * Returns 0 if the request succeeded and -1 if it failed.
+ */
+int disk_complete(disk_io_t *io)
+{
+    while (!io->done)
+    {
+        receive_reply(io->disk_num);
+    }
+    return io->status;
+}
+
+/* Collect the replies that arrive from any disk within timeout_ms
+ * milliseconds (-1 waits until at least one arrives), completing the
+ * requests they belong to.
+ *
+ * Returns the number of replies collected, or -1 if nothing is
+ * outstanding on any disk.
+ */
+int disk_poll(int timeout_ms)
+{
+    struct pollfd fds[num_disks + 1];
+    int waiting = 0;
+
+    for (int i = 0; i < num_disks + 1; i++)
+    {
+        fds[i].fd = controllers[i].outstanding > 0 ? controllers[i].from_disk[0] : -1;
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+        waiting += controllers[i].outstanding > 0;
+    }
+    if (!waiting)
+    {
+        return -1;
+    }
+
+    if (poll(fds, num_disks + 1, timeout_ms) < 0)
+    {
+        return 0;
+    }
+
+    int collected = 0;
+    for (int i = 0; i < num_disks + 1; i++)
+    {
+        if (fds[i].revents)
+        {
+            receive_reply(i);
+            collected++;
+        }
+    }
+    return collected;
+}
+
+/* Return 1 if the block at stripe_num on disk disk_num cannot be read
+ * from the disk, because the disk is degraded or that stripe of it has
+ * not been rebuilt yet.
+ */
+static int unit_stale(int disk_num, int stripe_num)
+{
+    if (disk_num == degraded_disk)
+    {
+        return 1;
+    }
+
+    return disk_num == rebuilding_disk && stripe_num >= rebuild_watermark &&
+           !(image_valid[disk_num] && !stripe_dirty(disk_num, stripe_num));
+}
+
+/* Wait for the outstanding read-ahead requests and put the blocks read
+ * into the cache. A disk that failed is left to be restored by the next
+ * request that needs it.
+ */
+static void finish_prefetch()
+{
+    for (int i = 0; i < prefetch_count; i++)
+    {
+        if (disk_complete(&prefetch_ios[i]) == 0)
+        {
+            cache_store(prefetch_ios[i].disk_num, prefetch_ios[i].stripe_num,
+                        prefetch_ios[i].data, 1);
+        }
+    }
+    prefetch_count = 0;
+}
+
+/* Start reading stripe_num from every disk into the cache, without
+ * waiting for the reads to complete.
+ */
+static void start_prefetch(int stripe_num)
+{
+    finish_prefetch();
+    prefetch_stripe = stripe_num;
+
+    for (int i = 0; i < num_disks + 1; i++)
+    {
+        // a block the disk cannot supply yet is left to be reconstructed
+        if (cache_contains(i, stripe_num) || unit_stale(i, stripe_num))
+        {
+            continue;
+        }
+
+        disk_io_t *io = &prefetch_ios[prefetch_count];
+        *io = (disk_io_t){i, CMD_READ, stripe_num,
+                          &prefetch_data[(size_t)prefetch_count * block_size], 0, 0};
+        prefetch_count++;
+        disk_submit(io);
+    }
+}
+
+/* Reconstruct the block at stripe_num on disk disk_num into data from
+ * the same stripe on every other disk, which XORs to it.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int reconstruct_unit(int disk_num, int stripe_num, char *data)
+{
+    char other_blocks[num_disks][block_size];
+    disk_io_t ios[num_disks];
+    int n = 0;
+
+    for (int i = 0; i < num_disks + 1; i++)
+    {
+        if (i != disk_num)
+        {
+            ios[n] = (disk_io_t){i, CMD_READ, stripe_num, other_blocks[n], 0, 0};
+            n++;
+        }
+    }
+    if (do_units(ios, n) != 0)
+    {
+        return -1;
+    }
+
+    memset(data, 0, block_size);
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < block_size; j++)
+        {
+            data[j] ^= other_blocks[i][j];
+        }
+    }
+    return 0;
+}
+
+/* Return the time, as returned by stats_now, when the outstanding request
+ * io was sent to its disk, or 0 if it is not outstanding.
+ */
+static uint64_t issued_at(disk_io_t *io)
+{
+    disk_controller_t *dc = &controllers[io->disk_num];
+    for (int tag = 0; tag < queue_depth; tag++)
+    {
+        if (dc->inflight[tag] == io)
+        {
+            return dc->issued[tag];
+        }
+    }
+    return 0;
+}
+
+/* Stop waiting for io, if it is outstanding, so that it can go out of
+ * scope: a copy of it takes its place among the disk's orphans, and its
+ * reply is read into abandoned_data when it arrives, and discarded. The
+ * disk is told to drop it if it has not started on it.
+ */
+static void abandon_io(disk_io_t *io)
+{
+    disk_controller_t *dc = &controllers[io->disk_num];
+    for (int tag = 0; tag < queue_depth; tag++)
+    {
+        if (dc->inflight[tag] == io)
+        {
+            dc->orphans[tag] = (disk_io_t){io->disk_num, io->cmd, io->stripe_num, abandoned_data, 0, 0};
+            dc->inflight[tag] = &dc->orphans[tag];
+            dc->abandoned++;
+            disk_request_t cancel = {tag, CMD_CANCEL, io->stripe_num, 0};
+            if (!dc->failed)
+            {
+                send_all(io->disk_num, &cancel, sizeof(cancel));
+            }
+        }
+    }
+}
+
+/* Wait for the request io to complete, but no later than deadline, a
+ * time as returned by stats_now.
+ *
+ * Returns 1 if io has completed and 0 if the deadline passed first.
+ */
+static int complete_by(disk_io_t *io, uint64_t deadline)
+{
+    struct pollfd pfd = {controllers[io->disk_num].from_disk[0], POLLIN, 0};
+    while (!io->done)
+    {
+        uint64_t now = stats_now();
+        if (now >= deadline)
+        {
+            return 0;
+        }
+        struct timespec timeout = {(deadline - now) / 1000000000, (deadline - now) % 1000000000};
+        if (ppoll(&pfd, 1, &timeout, NULL) > 0)
+        {
+            receive_reply(io->disk_num);
+        }
+    }
+    return 1;
+}
+
+/* Read the replies that disk_num has already sent, without waiting for
+ * any more.
+ */
+static void collect_replies(int disk_num)
+{
+    struct pollfd pfd = {controllers[disk_num].from_disk[0], POLLIN, 0};
+    while (controllers[disk_num].outstanding > 0 && poll(&pfd, 1, 0) > 0)
+    {
+        receive_reply(disk_num);
+    }
+}
+
+/* Return 1 if the block at stripe_num on disk disk_num can be
+ * reconstructed instead of waiting for disk_num to read it: every other
+ * disk is up, up to date at that stripe and not behind.
+ */
+static int can_hedge(int disk_num, int stripe_num)
+{
+    for (int i = 0; i < num_disks + 1; i++)
+    {
+        if (i != disk_num &&
+            (controllers[i].failed || controllers[i].abandoned > 0 || unit_stale(i, stripe_num)))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Wait for the read io until the hedge deadline, and if its disk has not
+ * answered by then, also read the rest of its stripe to reconstruct the
+ * block, if can_hedge allows. Whichever finishes
+ * first completes io: the original reply, successful or not, or the
+ * reconstruction, if every block of it was read. The requests that lose
+ * are abandoned.
+ */
+static void hedge_read(disk_io_t *io)
+{
+    int stripe_num = io->stripe_num;
+    uint64_t issued = issued_at(io);
+    if (issued == 0 || !can_hedge(io->disk_num, stripe_num) || complete_by(io, issued + hedge_deadline))
+    {
+        return;
+    }
+
+    hedge_counts.hedged++;
+    char other_blocks[num_disks][block_size];
+    disk_io_t ios[num_disks];
+    int n = 0;
+    for (int i = 0; i < num_disks + 1; i++)
+    {
+        if (i == io->disk_num)
+        {
+            continue;
+        }
+        ios[n] = (disk_io_t){i, CMD_READ, stripe_num, other_blocks[n], 0, 0};
+        if (cache_lookup(i, stripe_num, other_blocks[n]) == 0)
+        {
+            ios[n].status = 0;
+            ios[n].done = 1;
+        }
+        else
+        {
+            disk_submit(&ios[n]);
+        }
+        n++;
+    }
+
+    int remaining = n;
+    int failed = 0;
+    while (!io->done && remaining > 0 && !failed)
+    {
+        disk_poll(-1);
+        remaining = 0;
+        for (int i = 0; i < n; i++)
+        {
+            remaining += !ios[i].done;
+            failed |= ios[i].done && ios[i].status != 0;
+        }
+    }
+
+    if (!io->done && remaining == 0 && !failed)
+    {
+        memset(io->data, 0, block_size);
+        for (int i = 0; i < n; i++)
+        {
+            for (int j = 0; j < block_size; j++)
+            {
+                io->data[j] ^= other_blocks[i][j];
+            }
+        }
+        abandon_io(io);
+        io->status = 0;
+        io->done = 1;
+        hedge_counts.won++;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        abandon_io(&ios[i]);
+    }
+}
+
+/* Return the hedged reads' counters.
+ */
+hedge_stats_t hedge_stats()
+{
+    return hedge_counts;
+}
+
+/* Submit the n requests in ios to their disks, then wait for all of them.
+ * Reads of blocks in the cache are answered from it, and the blocks read
+ * or written are stored in it. Requests to different disks are serviced
+ * at the same time.
+ *
+ * When a read finds that its disk has failed, and no other disk is down
+ * or being rebuilt, the disk becomes the degraded disk: the read, and
+ * every later read of that disk, is answered by reconstructing the block
+ * from the others, and the disk is restored later. Reads of stripes that
+ * a rebuild has not reached yet are reconstructed in the same way, as is
+ * a block that fails its checksum, which is then written back. Any
+ * other failed disk is restored once every request has completed, as is
+ * the degraded disk before a write.
+ *
+ * Returns 0 on success and -1 if any request failed.
+ */
+static int do_units(disk_io_t *ios, int n)
+{
+    // a read ahead of a block must not complete after a write to it
+    finish_prefetch();
+
+    for (int i = 0; i < n && degraded_disk >= 0; i++)
+    {
+        if (ios[i].cmd != CMD_READ)
+        {
+            restore_disk_process(degraded_disk);
+        }
+    }
+
+    // only a batch of reads is hedged, since the stripes it reads do not
+    // change while it is in flight
+    int hedge = hedge_percentile > 0;
+    for (int i = 0; i < n && hedge; i++)
+    {
+        hedge = ios[i].cmd == CMD_READ;
+    }
+    if (hedge && ((hedge_reads += n) >= HEDGE_REFRESH || hedge_deadline == 0))
+    {
+        hedge_deadline = stats_read_deadline(hedge_percentile);
+        hedge_reads = 0;
+    }
+    unsigned char diverted[n];
+
+    for (int i = 0; i < n; i++)
+    {
+        diverted[i] = 0;
+        if (ios[i].cmd == CMD_READ &&
+            cache_lookup(ios[i].disk_num, ios[i].stripe_num, ios[i].data) == 0)
+        {
+            ios[i].status = 0;
+            ios[i].done = 1;
+            continue;
+        }
+        if (ios[i].cmd == CMD_READ && unit_stale(ios[i].disk_num, ios[i].stripe_num))
+        {
+            // reconstructed below, once the other requests are on their way
+            ios[i].status = -1;
+            ios[i].done = 1;
+            continue;
+        }
+        if (hedge && controllers[ios[i].disk_num].abandoned > 0)
+        {
+            collect_replies(ios[i].disk_num);
+        }
+        if (hedge && controllers[ios[i].disk_num].abandoned > 0 &&
+            can_hedge(ios[i].disk_num, ios[i].stripe_num))
+        {
+            // the same, for a disk that is behind
+            diverted[i] = 1;
+            ios[i].status = -1;
+            ios[i].done = 1;
+            continue;
+        }
+        disk_submit(&ios[i]);
+    }
+
+    int status = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (hedge && hedge_deadline > 0 && !ios[i].done)
+        {
+            hedge_read(&ios[i]);
+        }
+        disk_complete(&ios[i]);
+
+        int disk_num = ios[i].disk_num;
+        if (ios[i].status != 0 && ios[i].cmd == CMD_READ && controllers[disk_num].failed)
+        {
+            degrade_disk(disk_num);
+        }
+        if (diverted[i])
+        {
+            hedge_counts.diverted++;
+            ios[i].status = reconstruct_unit(disk_num, ios[i].stripe_num, ios[i].data);
+        }
+        else if (ios[i].status != 0 && ios[i].cmd == CMD_READ && unit_stale(disk_num, ios[i].stripe_num))
+        {
+            ios[i].status = reconstruct_unit(disk_num, ios[i].stripe_num, ios[i].data);
+        }
+        if (ios[i].status == STATUS_BAD_CHECKSUM)
+        {
+            ios[i].status = repair_unit(disk_num, ios[i].stripe_num, ios[i].data);
+        }
+
+        if (ios[i].status != 0)
+        {
+            status = -1;
+            cache_invalidate(disk_num, ios[i].stripe_num);
+        }
+        else if (ios[i].cmd == CMD_READ || ios[i].cmd == CMD_WRITE)
+        {
+            cache_store(disk_num, ios[i].stripe_num, ios[i].data, 0);
+        }
+        else if (ios[i].cmd == CMD_XOR_WRITE)
+        {
+            // the new block is only known to the disk
+            cache_invalidate(disk_num, ios[i].stripe_num);
+        }
+    }
+
+    // Handle disk failure, once per failed disk
+    for (int i = 0; i < n; i++)
+    {
+        if (controllers[ios[i].disk_num].failed && ios[i].disk_num != degraded_disk)
+        {
+            restore_disk_process(ios[i].disk_num);
+        }
+    }
+
+    return status;
+}
+
+/* Read the block at stripe_num on disk disk_num into data.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int read_unit(int disk_num, int stripe_num, char *data)
+{
+    disk_io_t io = {disk_num, CMD_READ, stripe_num, data, 0, 0};
+    return do_units(&io, 1);
+}
+
+/* Write the block pointed to by data to stripe_num on disk disk_num.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int write_unit(int disk_num, int stripe_num, char *data)
+{
+    disk_io_t io = {disk_num, CMD_WRITE, stripe_num, data, 0, 0};
+    return do_units(&io, 1);
+}
+
+/* Repair the block at stripe_num on disk disk_num, which has failed its
+ * checksum, by reconstructing it into data from the other disks and
+ * writing it back. That is only possible while all the other disks are
+ * up to date.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int repair_unit(int disk_num, int stripe_num, char *data)
+{
+    scrub_counts.bad_checksums++;
+    for (int i = 0; i < num_disks + 1; i++)
+    {
+        if (i != disk_num && (controllers[i].failed || unit_stale(i, stripe_num)))
+        {
+            fprintf(stderr, "Disk %d: block %d is corrupt and cannot be repaired while disk %d is down\n",
+                    disk_num, stripe_num, i);
+            return -1;
+        }
+    }
+
+    fprintf(stderr, "Disk %d: block %d is corrupt, repairing it from the other disks\n", disk_num, stripe_num);
+    if (reconstruct_unit(disk_num, stripe_num, data) != 0 ||
+        write_unit(disk_num, stripe_num, data) != 0)
+    {
+        return -1;
+    }
+    scrub_counts.repaired++;
+    return 0;
+}
+
+/* Read the block of data at block_num from the appropriate disk.
+ * The block is stored to the memory pointed to by data.
  *
- * If parity_flag == 1, read from parity disk.
+ * If parity_flag == 1, read from the parity disk of block_num's stripe.
  * If parity_flag == 0, read from data disk.
  *
  * Returns 0 on success and -1 on failure.
@@ -229,253 +1779,923 @@ int read_block_from_disk(int block_num, char *data, int parity_flag)
         return -1;
     }
 
-    // Identify the stripe to read from
+    // Each disk has a linear array of blocks, so the block number on an
+    // individual disk is the same as the stripe number
+    int stripe_num = block_num / num_disks;
+
+    // Identify the disk to read from
     int disk_num;
     if (parity_flag == 1)
     {
-        disk_num = num_disks;
+        disk_num = parity_disk(stripe_num);
     }
     else
     {
-        disk_num = block_num % num_disks;
+        disk_num = data_disk(block_num);
     }
 
-    // this is a constant
-    disk_command_t cmd = CMD_READ;
+    return read_unit(disk_num, stripe_num, data);
+}
 
-    // Each disk has a linear array of blocks, so the block number on an
-    // individual disk is the same as the stripe number
+/* Write a block of data to the block at block_num on the appropriate disk.
+ * The block is stored at the memory pointed to by data.
+ *
+ * If parity_flag == 1, write to the parity disk of block_num's stripe.
+ * If parity_flag == 0, write to data disk.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int write_block_to_disk(int block_num, char *data, int parity_flag)
+{
+    if (!data)
+    {
+        fprintf(stderr, "Error: Invalid data buffer for writing data");
+        return -1;
+    }
+
+    int stripe_num = block_num / num_disks;
+
+    int disk_num;
+    if (parity_flag == 1)
+    {
+        disk_num = parity_disk(stripe_num);
+    }
+    else
+    {
+        disk_num = data_disk(block_num);
+    }
+
+    return write_unit(disk_num, stripe_num, data);
+}
+
+/* Return the write-back buffer entry for stripe_num, or NULL if none of
+ * its blocks are buffered.
+ */
+static writeback_t *find_writeback(int stripe_num)
+{
+    for (int i = 0; i < writeback_stripes; i++)
+    {
+        if (writeback[i].stripe_num == stripe_num)
+        {
+            return &writeback[i];
+        }
+    }
+    return NULL;
+}
+
+/* Return the number of milliseconds since the time when.
+ */
+static long ms_since(struct timespec *when)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - when->tv_sec) * 1000 + (now.tv_nsec - when->tv_nsec) / 1000000;
+}
+
+/* Write the memory pointed to by data to the block at block_num on the
+ * RAID system. The old data is read from its disk, and the bits that
+ * change are sent to the parity disk, which flips them in the parity
+ * block itself with CMD_XOR_WRITE. The disk that failed, if any, is
+ * reported on stderr.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int write_block(int block_num, char *data)
+{
+    // here, data is the buffer and block_num is the block number we want to write to
+    // there is no need to process data since it is already the same number of bytes as block_num that
+    // we set at the start of the simulation
+    // the parity block is updated by the parity disk itself, which is sent
+    // the bits of the data that change
+
+    // Check if block_num is in range
+    if (block_num < 0 || block_num >= (disk_size / block_size) * num_disks)
+    {
+        fprintf(stderr, "Error: Invalid block number %d\n", block_num);
+        return -1;
+    }
+
+    if (writeback_stripes > 0)
+    {
+        return buffer_block(block_num, data);
+    }
+
+    // the old data, which becomes the change to the parity
+    char delta[block_size];
+    uint64_t started = stats_now();
+
+    // get the data from the disk to replace
+    int stripe_num = block_num / num_disks;
+    disk_io_t ios[2] = {
+        {data_disk(block_num), CMD_READ, stripe_num, delta, 0, 0},
+        {parity_disk(stripe_num), CMD_XOR_WRITE, stripe_num, delta, 0, 0},
+    };
+    if (do_units(ios, 1) != 0)
+    {
+        fprintf(stderr, "Error: Failed to read block %d from disk %d\n", block_num, ios[0].disk_num);
+        return -1;
+    }
+
+    // the parity flips wherever the data does: xoring the old data with the
+    // new gives the bits to flip, which the parity disk applies in place
+    for (int i = 0; i < block_size; i++)
+    {
+        delta[i] ^= data[i];
+    }
+
+    // write the new data to the data disk and update the parity block;
+    // both writes are in flight at once, the data first so that a parity
+    // block that must be repaired is rebuilt from the new data
+    ios[0].cmd = CMD_WRITE;
+    ios[0].data = data;
+    if (do_units(ios, 2) != 0)
+    {
+        fprintf(stderr, "Error: Failed to write block %d to disk %d\n", block_num,
+                ios[0].status != 0 ? ios[0].disk_num : ios[1].disk_num);
+        return -1;
+    }
+
+    stats_op(STATS_PARITY_UPDATE, block_size, stats_now() - started);
+    return 0;
+}
+
+/* Write the count * num_disks blocks at data as the data blocks of count
+ * consecutive stripes, starting at stripe_num, with the parity of each
+ * stripe computed from its data alone.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int write_stripe_blocks(int stripe_num, int count, char *data)
+{
+    disk_io_t ios[queue_depth * (num_disks + 1)];
+    uint64_t started = stats_now();
+
+    // the writes of each stripe go to different disks, and those of up
+    // to queue_depth stripes are in flight at once
+    for (int s = 0; s < count; s += queue_depth)
+    {
+        int batch = count - s < queue_depth ? count - s : queue_depth;
+        int k = 0;
+
+        for (int b = 0; b < batch; b++)
+        {
+            int stripe = stripe_num + s + b;
+            char *parity_data = &stripe_parity[(size_t)b * block_size];
+            memset(parity_data, 0, block_size);
+
+            for (int i = 0; i < num_disks; i++)
+            {
+                char *block = &data[((size_t)(s + b) * num_disks + i) * block_size];
+                for (int j = 0; j < block_size; j++)
+                {
+                    parity_data[j] ^= block[j];
+                }
+
+                ios[k++] = (disk_io_t){data_disk(stripe * num_disks + i), CMD_WRITE, stripe, block, 0, 0};
+            }
+            ios[k++] = (disk_io_t){parity_disk(stripe), CMD_WRITE, stripe, parity_data, 0, 0};
+        }
+
+        if (do_units(ios, k) != 0)
+        {
+            return -1;
+        }
+    }
+
+    stats_op(STATS_FULL_STRIPE, (long)count * num_disks * block_size, stats_now() - started);
+    return 0;
+}
+
+/* Write count consecutive full stripes, starting at stripe_num, from the
+ * count * num_disks blocks at data, replacing any of their blocks that
+ * are still buffered.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int write_stripes(int stripe_num, int count, char *data)
+{
+    if (stripe_num < 0 || count < 0 || stripe_num + count > disk_size / block_size)
+    {
+        fprintf(stderr, "Error: Invalid stripe number %d\n",
+                stripe_num < 0 ? stripe_num : stripe_num + count - 1);
+        return -1;
+    }
+
+    for (int s = stripe_num; s < stripe_num + count; s++)
+    {
+        writeback_t *wb = find_writeback(s);
+        if (wb)
+        {
+            wb->stripe_num = -1;
+        }
+    }
+
+    return write_stripe_blocks(stripe_num, count, data);
+}
+
+/* Write a full stripe to the RAID system. data points to num_disks
+ * consecutive blocks that become data blocks stripe_num * num_disks
+ * through stripe_num * num_disks + num_disks - 1.
+ *
+ * Since every data block of the stripe is replaced, the new parity is
+ * computed from data alone, so no old data or parity has to be read
+ * and only num_disks + 1 writes are sent to the disks.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int write_stripe(int stripe_num, char *data)
+{
+    return write_stripes(stripe_num, 1, data);
+}
+
+/* Write the blocks buffered in wb to the disks with one parity update.
+ *
+ * A full stripe is written with write_stripe. Otherwise the parity is
+ * updated in whichever way needs fewer reads: by reading the old contents
+ * of the buffered blocks and sending the parity disk the bits that change
+ * (read-modify-write), or by computing it from the buffered blocks and
+ * the rest of the stripe read from the disks (reconstruct-write). Either
+ * way the buffered blocks and the parity update are then sent in
+ * parallel.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int write_buffered_stripe(writeback_t *wb)
+{
+    if (wb->count == num_disks)
+    {
+        writeback_counts.full_stripes++;
+        return write_stripe_blocks(wb->stripe_num, 1, wb->data);
+    }
+
+    int stripe_num = wb->stripe_num;
+    uint64_t started = stats_now();
+    char old_blocks[num_disks][block_size];
+    char parity_data[block_size]; // the new parity, or the change to it
+    disk_io_t ios[num_disks + 1];
+    int n = 0;
+
+    int read_modify_write = wb->count <= num_disks - wb->count;
+    for (int i = 0; i < num_disks; i++)
+    {
+        if (wb->present[i] == read_modify_write)
+        {
+            ios[n++] = (disk_io_t){data_disk(stripe_num * num_disks + i), CMD_READ,
+                                   stripe_num, old_blocks[i], 0, 0};
+        }
+    }
+    memset(parity_data, 0, block_size);
+
+    if (do_units(ios, n) != 0)
+    {
+        return -1;
+    }
+
+    n = 0;
+    for (int i = 0; i < num_disks; i++)
+    {
+        char *block = &wb->data[(size_t)i * block_size];
+        if (wb->present[i])
+        {
+            // only the bits that change reach the parity disk
+            for (int j = 0; j < block_size; j++)
+            {
+                parity_data[j] ^= block[j] ^ (read_modify_write ? old_blocks[i][j] : 0);
+            }
+            ios[n++] = (disk_io_t){data_disk(stripe_num * num_disks + i), CMD_WRITE,
+                                   stripe_num, block, 0, 0};
+        }
+        else if (!read_modify_write)
+        {
+            for (int j = 0; j < block_size; j++)
+            {
+                parity_data[j] ^= old_blocks[i][j];
+            }
+        }
+    }
+    ios[n++] = (disk_io_t){parity_disk(stripe_num), read_modify_write ? CMD_XOR_WRITE : CMD_WRITE,
+                           stripe_num, parity_data, 0, 0};
+
+    if (do_units(ios, n) != 0)
+    {
+        return -1;
+    }
+    stats_op(STATS_PARITY_UPDATE, (long)wb->count * block_size, stats_now() - started);
+    return 0;
+}
+
+/* Write the stripe buffered in wb to the disks and release the entry.
+ * A disk that fails during the write is restored and rebuilt, which
+ * leaves the stripe consistent, so the write is tried once more.
+ *
+ * Returns 0 on success and -1 if the buffered blocks were lost.
+ */
+static int flush_stripe(writeback_t *wb)
+{
+    int status = write_buffered_stripe(wb);
+    if (status != 0)
+    {
+        status = write_buffered_stripe(wb);
+    }
+    if (status != 0)
+    {
+        fprintf(stderr, "Failed to write buffered stripe %d\n", wb->stripe_num);
+    }
+
+    writeback_counts.stripes++;
+    wb->stripe_num = -1;
+    return status;
+}
+
+/* Flush every buffered stripe that has been waiting for at least
+ * WRITEBACK_DELAY_MS.
+ *
+ * Returns 0 on success and -1 if any buffered blocks were lost.
+ */
+static int flush_expired()
+{
+    int status = 0;
+    for (int i = 0; i < writeback_stripes; i++)
+    {
+        if (writeback[i].stripe_num >= 0 && ms_since(&writeback[i].since) >= WRITEBACK_DELAY_MS &&
+            flush_stripe(&writeback[i]) != 0)
+        {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+/* Write every stripe in the write-back buffer to the disks.
+ *
+ * Returns 0 on success and -1 if any buffered blocks were lost.
+ */
+int flush_writeback()
+{
+    int status = 0;
+    for (int i = 0; i < writeback_stripes; i++)
+    {
+        if (writeback[i].stripe_num >= 0 && flush_stripe(&writeback[i]) != 0)
+        {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+/* Return the write-back buffer's counters.
+ */
+writeback_stats_t writeback_stats()
+{
+    return writeback_counts;
+}
+
+/* Copy data into the write-back buffer as the block block_num. If the
+ * stripe has no entry yet, it takes a free one, or the one buffered the
+ * longest, which is flushed first.
+ *
+ * Returns 0 on success and -1 if buffered blocks were lost.
+ */
+static int buffer_block(int block_num, char *data)
+{
     int stripe_num = block_num / num_disks;
+    int index = block_num % num_disks;
+    int status = 0;
+
+    writeback_t *wb = find_writeback(stripe_num);
+    if (!wb)
+    {
+        for (int i = 0; i < writeback_stripes; i++)
+        {
+            if (writeback[i].stripe_num < 0)
+            {
+                wb = &writeback[i];
+                break;
+            }
+            if (!wb || ms_since(&writeback[i].since) > ms_since(&wb->since))
+            {
+                wb = &writeback[i];
+            }
+        }
+        if (wb->stripe_num >= 0)
+        {
+            status = flush_stripe(wb);
+        }
+
+        wb->stripe_num = stripe_num;
+        wb->count = 0;
+        memset(wb->present, 0, num_disks);
+        clock_gettime(CLOCK_MONOTONIC, &wb->since);
+    }
+
+    if (!wb->present[index])
+    {
+        wb->present[index] = 1;
+        wb->count++;
+    }
+    memcpy(&wb->data[(size_t)index * block_size], data, block_size);
+    writeback_counts.blocks++;
+
+    // nothing is gained by waiting once the whole stripe is buffered
+    if (wb->count == num_disks && flush_stripe(wb) != 0)
+    {
+        status = -1;
+    }
+    if (flush_expired() != 0)
+    {
+        status = -1;
+    }
+    return status;
+}
+
+/* Do background work for the controller while the shell waits for the
+ * next command: restore a degraded disk, rebuild the next batch of
+ * stripes of a disk being rebuilt if the rebuild rate allows it, and
+ * write out the buffered stripes that have waited long enough.
+ *
+ * Returns the number of milliseconds until there is more work to do, or
+ * -1 if there is none.
+ */
+int controller_idle()
+{
+    watch_disks(0);
+
+    if (degraded_disk >= 0)
+    {
+        restore_disk_process(degraded_disk);
+    }
+
+    long wait = -1;
+    if (rebuilding_disk >= 0)
+    {
+        // the stripes the rate allows by now, less those already rebuilt
+        long allowed = REBUILD_BATCH;
+        if (rebuild_rate > 0)
+        {
+            allowed += rebuild_rate * ms_since(&rebuild_started) / 1000 - rebuild_count;
+        }
+        if (allowed > 0)
+        {
+            rebuild_stripes(allowed < REBUILD_BATCH ? allowed : REBUILD_BATCH);
+            wait = 0;
+        }
+        else
+        {
+            wait = 1000 * (1 - allowed) / rebuild_rate + 1;
+        }
+        if (rebuilding_disk < 0)
+        {
+            wait = -1;
+        }
+    }
+
+    if (scrub_rate > 0 && degraded_disk < 0 && rebuilding_disk < 0)
+    {
+        long allowed = SCRUB_BATCH + scrub_rate * ms_since(&scrub_started) / 1000 - scrub_count;
+        // time spent on other work is not made up for by scrubbing faster
+        if (allowed > SCRUB_BATCH)
+        {
+            scrub_count += allowed - SCRUB_BATCH;
+            allowed = SCRUB_BATCH;
+        }
+
+        long left = 0;
+        if (allowed > 0)
+        {
+            scrub_stripes(allowed);
+        }
+        else
+        {
+            left = 1000 * (1 - allowed) / scrub_rate + 1;
+        }
+        if (wait < 0 || left < wait)
+        {
+            wait = left;
+        }
+    }
 
-    // Write the command and the block number to the disk process
-    // Then read the block from the disk process
+    flush_expired();
 
-    // Send the command to the disk
-    ssize_t cmd_written = write(controllers[disk_num].to_disk[1], &cmd, sizeof(cmd));
-    if (cmd_written != sizeof(cmd))
+    // start new spares in place of those that have taken over a disk
+    for (int i = num_disks + 1; i < num_disks + 1 + spare_disks; i++)
     {
-        // Handle disk failure
-        fprintf(stderr, "Failed to send READ command to disk %d\n", disk_num);
-        restore_disk_process(disk_num);
-        return -1;
+        if (controllers[i].failed && init_disk(i) != 0)
+        {
+            controllers[i].failed = 1;
+        }
     }
 
-    // Then send the stripe number to the disk
-    ssize_t block_written = write(controllers[disk_num].to_disk[1], &stripe_num, sizeof(stripe_num));
-    if (block_written != sizeof(stripe_num))
+    for (int i = 0; i < writeback_stripes; i++)
     {
-        // Handle disk failure
-        fprintf(stderr, "Failed to send block number to disk %d\n", disk_num);
-        restore_disk_process(disk_num);
-        return -1;
+        if (writeback[i].stripe_num >= 0)
+        {
+            long left = WRITEBACK_DELAY_MS - ms_since(&writeback[i].since);
+            if (wait < 0 || left < wait)
+            {
+                wait = left > 0 ? left : 0;
+            }
+        }
     }
+    return (int)wait;
+}
 
-    // Read the block data returned by the disk
-    ssize_t bytes_read = read(controllers[disk_num].from_disk[0], data, block_size);
-    if (bytes_read != block_size)
+/* Write count consecutive blocks, starting at block_num, from the
+ * memory pointed to by data.
+ *
+ * Stripes that are completely covered by the range are written as by
+ * write_stripe, with up to queue_depth of them in flight at once, and
+ * the partial stripes at either end fall back to write_block's
+ * read-modify-write of the parity block.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int write_blocks(int block_num, int count, char *data)
+{
+    if (block_num < 0 || count < 0 ||
+        block_num + count > (disk_size / block_size) * num_disks)
     {
-        // Handle disk failure
-        fprintf(stderr, "Failed to read data from disk %d\n", disk_num);
-        restore_disk_process(disk_num);
+        fprintf(stderr, "Error: Invalid block range %d-%d\n", block_num, block_num + count - 1);
         return -1;
     }
 
+    int i = 0;
+    while (i < count)
+    {
+        char *block = &data[(size_t)i * block_size];
+
+        if ((block_num + i) % num_disks == 0 && count - i >= num_disks)
+        {
+            int stripes = (count - i) / num_disks;
+            if (write_stripes((block_num + i) / num_disks, stripes, block) != 0)
+            {
+                return -1;
+            }
+            i += stripes * num_disks;
+        }
+        else
+        {
+            if (write_block(block_num + i, block) != 0)
+            {
+                return -1;
+            }
+            i++;
+        }
+    }
+
     return 0;
 }
 
-/* Write a block of data to the block at block_num on the appropriate disk.
- * The block is stored at the memory pointed to by data.
- *
- * If parity_flag == 1, write to parity disk.
- * If parity_flag == 0, write to data disk.
+/* Read the block at block_num from the RAID system into
+ * the memory pointed to by data.
+ * If block_num is invalid (outside the range 0 to disk_size/block_size * num_disks)
+ * then return NULL.
  *
- * Returns 0 on success and -1 on failure.
+ * Returns a pointer to the data buffer on success and NULL on failure.
  */
-int write_block_to_disk(int block_num, char *data, int parity_flag)
+char *read_block(int block_num, char *data)
 {
-    if (!data)
+    // Check if block_num is in range
+    if (block_num < 0 || block_num >= (disk_size / block_size) * num_disks)
     {
-        fprintf(stderr, "Error: Invalid data buffer for writing data");
+        fprintf(stderr, "Error: Invalid block number %d\n", block_num);
+        return NULL;
     }
 
-    int disk_num;
-    if (parity_flag == 1)
+    // a block in the write-back buffer is newer than the copy on disk
+    writeback_t *wb = find_writeback(block_num / num_disks);
+    if (wb && wb->present[block_num % num_disks])
     {
-        // assign it to the last disk, which isthe parity disk
-        disk_num = num_disks;
+        memcpy(data, &wb->data[(size_t)(block_num % num_disks) * block_size], block_size);
+        return data;
     }
-    else
+
+    uint64_t started = stats_now();
+    if (read_block_from_disk(block_num, data, 0) != 0)
     {
-        disk_num = block_num % num_disks;
+        // failed to read data from disk
+        fprintf(stderr, "Failed to read data from disk");
+        return NULL;
     }
-
-    disk_command_t cmd = CMD_WRITE;
-
-    int stripe_num = block_num / num_disks;
-
-    // send the command to the disk (READ or WRITE)
-    // to_disk[1] is write, to_disk[0] is read
-    // controllers is an array of all the disk processes, disk_num is the specific
-    // disk that we want to write to
-    ssize_t cmd_written = write(controllers[disk_num].to_disk[1], &cmd, sizeof(cmd));
-    if (cmd_written != sizeof(cmd))
+    stats_op(STATS_READ, block_size, stats_now() - started);
+
+    // A reader moving through consecutive blocks will want the next
+    // stripe soon, so it is read from all the disks while the caller
+    // uses this block
+    int next_stripe = block_num / num_disks + 1;
+    if (cache_blocks > 0 && block_num == last_read_block + 1 &&
+        next_stripe != prefetch_stripe && next_stripe < disk_size / block_size)
     {
-        // handle possible disk failure
-        restore_disk_process(disk_num);
-        return -1;
+        start_prefetch(next_stripe);
     }
+    last_read_block = block_num;
+
+    return data;
+}
 
-    // 2. Send the block number (stripe_num) to the disk
-    ssize_t block_written = write(controllers[disk_num].to_disk[1], &stripe_num, sizeof(stripe_num));
-    if (block_written != sizeof(stripe_num))
+/* Read count consecutive blocks, starting at block_num, into the memory
+ * pointed to by data.
+ *
+ * Consecutive blocks are on different disks, so the blocks of as many
+ * stripes as a disk can have requests outstanding are read at once, and
+ * every disk is kept busy. Blocks in the write-back buffer are copied
+ * from it instead.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int read_blocks(int block_num, int count, char *data)
+{
+    if (block_num < 0 || count < 0 ||
+        block_num + count > (disk_size / block_size) * num_disks)
     {
-        // Handle possible disk failure
-        restore_disk_process(disk_num);
+        fprintf(stderr, "Error: Invalid block range %d-%d\n", block_num, block_num + count - 1);
         return -1;
     }
 
-    // 3. Send the actual block data
-    ssize_t data_written = write(controllers[disk_num].to_disk[1], data, block_size);
-    if (data_written != block_size)
+    disk_io_t ios[queue_depth * num_disks];
+    uint64_t started = stats_now();
+    int i = 0;
+    while (i < count)
     {
-        // Handle possible disk falure
-        restore_disk_process(disk_num);
-        return -1;
+        // the rest of the range, up to the end of the queue_depth-th stripe
+        int end = ((block_num + i) / num_disks + queue_depth) * num_disks - block_num;
+        if (end > count)
+        {
+            end = count;
+        }
+
+        int n = 0;
+        for (; i < end; i++)
+        {
+            int b = block_num + i;
+            char *block = &data[(size_t)i * block_size];
+
+            writeback_t *wb = find_writeback(b / num_disks);
+            if (wb && wb->present[b % num_disks])
+            {
+                memcpy(block, &wb->data[(size_t)(b % num_disks) * block_size], block_size);
+                continue;
+            }
+            ios[n++] = (disk_io_t){data_disk(b), CMD_READ, b / num_disks, block, 0, 0};
+        }
+
+        if (do_units(ios, n) != 0)
+        {
+            return -1;
+        }
     }
 
+    stats_op(STATS_READ, (long)count * block_size, stats_now() - started);
     return 0;
 }
 
-/* Write the memory pointed to by data to the block at block_num on the
- * RAID system, handling parity updates.
- * If block_num is invalid (outside the range 0 to disk_size/block_size)
- * then return NULL.
+/* Carry out the n reads and writes of single blocks in batch, where n is
+ * at most queue_depth, as though they were done one after another. No two
+ * of them may touch the same stripe if either is a write; the requests of
+ * all of them are then in flight together. The reads, and the reads of the
+ * old data for every write, are sent first; the new data of every write,
+ * and the change to its parity, follow once those complete.
+ *
+ * With the write-back buffer enabled the accesses are done one at a time,
+ * by write_block and read_block, since most never reach the disks.
  *
- * Returns 0 on success and the disk number we tried to read from on failure.
+ * Sets the status of each access, and returns 0 if all of them succeeded
+ * and -1 otherwise.
  */
-int write_block(int block_num, char *data)
+int access_blocks(block_access_t *batch, int n)
 {
-    // here, data is the buffer and block_num is the block number we want to write to
-    // we first need to call write_block_to_disk with parity flag 0 to write it to data storage
-    // there is no need to process data since it is already the same number of bytes as block_num that
-    // we set at the start of the simulation
-    // we do however need to calculate the parity block
-    // we then need to call write_block_to_disk with parity flag 1 to write it to the parity disk
+    disk_io_t ios[queue_depth];
+    disk_io_t writes[2 * queue_depth];
+    uint64_t started = stats_now();
+    int m = 0;
+    int status = 0;
 
-    // Check if block_num is in range
-    if (block_num < 0 || block_num >= (disk_size / block_size) * num_disks)
+    for (int i = 0; i < n; i++)
     {
-        fprintf(stderr, "Error: Invalid block number %d\n", block_num);
-        return -1;
-    }
-
-    // buffers for old_data and the parity
-    char old_data[block_size];
-    char parity_data[block_size];
+        block_access_t *a = &batch[i];
+        a->status = -1;
+        if (writeback_stripes > 0)
+        {
+            a->status = a->write ? write_block(a->block_num, a->data)
+                                 : (read_block(a->block_num, a->data) ? 0 : -1);
+            if (a->status != 0)
+            {
+                a->status = -1;
+                status = -1;
+            }
+            continue;
+        }
+        if (a->block_num < 0 || a->block_num >= (disk_size / block_size) * num_disks)
+        {
+            fprintf(stderr, "Error: Invalid block number %d\n", a->block_num);
+            status = -1;
+            continue;
+        }
 
-    // get the data from the disk to replace
-    if (read_block_from_disk(block_num, old_data, 0) != 0)
-    {
-        // Handle error
-        return block_num % num_disks;
+        int stripe_num = a->block_num / num_disks;
+        if (!a->write)
+        {
+            ios[m++] = (disk_io_t){data_disk(a->block_num), CMD_READ, stripe_num, a->data, 0, 0};
+            continue;
+        }
+        char *old_data = &access_data[(size_t)i * block_size];
+        ios[m++] = (disk_io_t){data_disk(a->block_num), CMD_READ, stripe_num, old_data, 0, 0};
     }
-
-    // get the current parity disk
-    if (read_block_from_disk(block_num, parity_data, 1) != 0)
+    if (writeback_stripes > 0)
     {
-        // Handle error
-        return num_disks; // Parity disk
+        return status;
     }
-
-    // to update the parity:
-    // 1. we first xor the current parity with the old data disk contents, to cancel it out
-    // 2. we then xor the intermediate parity with the new data disk contents
-    for (int i = 0; i < block_size; i++)
+    do_units(ios, m);
+
+    // the reads are done; each write whose old data was read becomes a
+    // write of its data and an XOR write of the change to its parity
+    int writer[queue_depth];
+    int k = 0;
+    int w = 0;
+    for (int i = 0; i < n; i++)
     {
-        parity_data[i] = parity_data[i] ^ old_data[i] ^ data[i];
+        block_access_t *a = &batch[i];
+        if (a->block_num < 0 || a->block_num >= (disk_size / block_size) * num_disks)
+        {
+            continue;
+        }
+        if (!a->write)
+        {
+            a->status = ios[k++].status;
+            continue;
+        }
+
+        disk_io_t *old_io = &ios[k++];
+        if (old_io->status != 0)
+        {
+            continue;
+        }
+
+        char *delta = old_io->data;
+        for (int j = 0; j < block_size; j++)
+        {
+            delta[j] ^= a->data[j];
+        }
+        writes[w] = (disk_io_t){old_io->disk_num, CMD_WRITE, old_io->stripe_num, a->data, 0, 0};
+        writes[w + 1] = (disk_io_t){parity_disk(old_io->stripe_num), CMD_XOR_WRITE, old_io->stripe_num,
+                                    delta, 0, 0};
+        writer[w / 2] = i;
+        w += 2;
     }
 
-    // write the new data to the data disk
-    if (write_block_to_disk(block_num, data, 0) != 0)
+    do_units(writes, w);
+    for (int j = 0; j < w; j += 2)
     {
-        return block_num % num_disks;
+        batch[writer[j / 2]].status = (writes[j].status != 0 || writes[j + 1].status != 0) ? -1 : 0;
     }
 
-    // update the parity disk
-    if (write_block_to_disk(block_num, parity_data, 1) != 0)
+    uint64_t elapsed = stats_now() - started;
+    for (int i = 0; i < n; i++)
     {
-        return num_disks;
+        if (batch[i].status != 0)
+        {
+            status = -1;
+        }
+        else
+        {
+            stats_op(batch[i].write ? STATS_PARITY_UPDATE : STATS_READ, block_size, elapsed);
+        }
     }
-
-    return 0;
+    return status;
 }
 
-/* Read the block at block_num from the RAID system into
- * the memory pointed to by data.
- * If block_num is invalid (outside the range 0 to disk_size/block_size * num_disks)
- * then return NULL.
+/* Ask every disk to write the blocks changed since its last checkpoint
+ * to its image file. Each disk that succeeds has an image that is up to
+ * date in this generation, so its write-intent bitmap is cleared.
  *
- * Returns a pointer to the data buffer on success and NULL on failure.
+ * Returns 0 if every disk checkpointed and -1 otherwise.
  */
-char *read_block(int block_num, char *data)
+int checkpoint_disks()
 {
-    // TODO: Complete this function
+    // a degraded disk is brought up to date so that it has an image too
+    if (degraded_disk >= 0)
+    {
+        restore_disk_process(degraded_disk);
+    }
+    finish_rebuild();
 
-    // Check if block_num is in range
-    if (block_num < 0 || block_num >= (disk_size / block_size) * num_disks)
+    int status = flush_writeback();
+    disk_io_t ios[num_disks + 1];
+
+    finish_prefetch();
+
+    // send the requests to all disks first so they checkpoint in parallel
+    for (int i = 0; i < num_disks + 1; i++)
     {
-        fprintf(stderr, "Error: Invalid block number %d\n", block_num);
-        return NULL;
+        ios[i] = (disk_io_t){i, CMD_CHECKPOINT, 0, NULL, 0, 0};
+        disk_submit(&ios[i]);
     }
 
-    if (read_block_from_disk(block_num, data, 0) != 0)
+    for (int i = 0; i < num_disks + 1; i++)
     {
-        // failed to read data from disk
-        fprintf(stderr, "Failed to read data from disk");
-        return NULL;
+        if (disk_complete(&ios[i]) != 0)
+        {
+            fprintf(stderr, "Warning: Disk %d failed to checkpoint\n", i);
+            status = -1;
+            continue;
+        }
+
+        disk_generation[i] = superblock.generation;
+        image_valid[i] = 1;
+        reset_intent(i, superblock.generation);
     }
 
-    return data;
+    save_superblock();
+    return status;
 }
 
 /* Send exit command to all disk processes.
  *
- * Returns when all disk processes have terminated.
+ * Returns when all disk processes have terminated, after recording in
+ * the superblock which disks checkpointed their images successfully.
  */
 void checkpoint_and_wait()
 {
+    // a degraded disk is brought up to date so that it has an image too,
+    // and the image of a disk must not be saved half rebuilt
+    if (degraded_disk >= 0)
+    {
+        restore_disk_process(degraded_disk);
+    }
+    finish_rebuild();
+
+    if (flush_writeback() != 0)
+    {
+        fprintf(stderr, "Warning: Buffered writes were lost\n");
+    }
+
+    // a disk must not be left blocked sending a block nobody reads
+    finish_prefetch();
+
     for (int i = 0; i < num_disks + 1; i++)
     {
-        disk_command_t cmd = CMD_EXIT;
-        ssize_t bytes_written = write(controllers[i].to_disk[1], &cmd, sizeof(cmd));
-        if (bytes_written != sizeof(cmd))
+        disk_request_t req = {0, CMD_EXIT, 0, 0};
+        if (controllers[i].failed || send_all(i, &req, sizeof(req)) != 0)
         {
             fprintf(stderr, "Warning: Failed to send exit command to disk %d\n", i);
         }
     }
-    // wait for all disks to exit
-    // we aren't going to do anything with the exit value
+    // wait for all disks to exit; a disk that exits with status 0 has
+    // checkpointed its image, which now belongs to this generation
     for (int i = 0; i < num_disks + 1; i++)
     {
-        wait(NULL);
+        int status;
+        if (waitpid(controllers[i].pid, &status, 0) == controllers[i].pid &&
+            WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        {
+            disk_generation[i] = superblock.generation;
+            image_valid[i] = 1;
+            reset_intent(i, superblock.generation);
+        }
+    }
+
+    // the spares have no images, so they just exit
+    for (int i = num_disks + 1; i < num_disks + 1 + spare_disks; i++)
+    {
+        disk_request_t req = {0, CMD_EXIT, 0, 0};
+        if (!controllers[i].failed && send_all(i, &req, sizeof(req)) == 0)
+        {
+            waitpid(controllers[i].pid, NULL, 0);
+        }
     }
+
+    save_superblock();
 }
 
 /* Simulate the failure of a disk by sending the SIGINT signal to the
- * process with id disk_num.
+ * process with id disk_num. A disk that has already failed is left alone,
+ * since its process may have been reaped and its pid reused.
  */
 void simulate_disk_failure(int disk_num)
 {
+    if (disk_num == degraded_disk || controllers[disk_num].failed)
+    {
+        fprintf(stderr, "Disk %d has already failed\n", disk_num);
+        return;
+    }
     if (debug)
     {
         printf("Simulate: killing disk %d\n", disk_num);
     }
     kill(controllers[disk_num].pid, SIGINT);
 
-    // avoiding a race condition (from faq)
-    if (waitpid(controllers[disk_num].pid, NULL, 0) == -1)
+    // avoiding a race condition (from faq): the supervisor sees the disk
+    // exit before the next command is run, which then finds it restored
+    if (controllers[disk_num].pidfd < 0)
+    {
+        if (waitpid(controllers[disk_num].pid, NULL, 0) == -1)
+        {
+            perror("simulate_disk_failure: waitpid");
+        }
+        return;
+    }
+    while (controllers[disk_num].pidfd >= 0)
     {
-        perror("simulate_disk_failure: waitpid");
+        watch_disks(-1);
     }
 }
 
@@ -483,74 +2703,258 @@ void simulate_disk_failure(int disk_num)
  * If some aspect of restoring the disk process fails,
  * then you can consider it a catastropic failure and
  * exit the program.
+ *
+ * The disk's lost data is rebuilt from the other disks in the
+ * background if rebuild_rate is set, and before returning otherwise.
  */
 void restore_disk_process(int disk_num)
 {
-    // TODO: Complete this function
+    if (degraded_disk == disk_num)
+    {
+        degraded_disk = -1;
+    }
 
     // first we restart the disk
+    uint64_t started = stats_now();
     if (restart_disk(disk_num) != 0)
     {
         fprintf(stderr, "disk %d failed to restart\n", disk_num);
         exit(1);
     }
+    trace_event(TRACE_RESTORE, disk_num, -1, started);
 
     // then we recalculate the lost data
+    start_rebuild(disk_num);
+    if (rebuild_rate == 0)
+    {
+        finish_rebuild();
+    }
+}
 
-    // number of stripes
-    int blocks_per_disk = disk_size / block_size;
+/* Start rebuilding disk disk_num, which has just been restarted, from
+ * the first stripe. A disk can only be rebuilt while all the others are
+ * up to date, so a second failure is treated as catastrophic.
+ */
+static void start_rebuild(int disk_num)
+{
+    if ((rebuilding_disk >= 0 && rebuilding_disk != disk_num) || degraded_disk >= 0)
+    {
+        fprintf(stderr, "Disk %d failed while disk %d was down, data has been lost\n", disk_num,
+                rebuilding_disk >= 0 ? rebuilding_disk : degraded_disk);
+        exit(1);
+    }
 
-    // buffer for the lost data
-    char lost_disk_buffer[block_size];
-    // this stores the parity block
-    char parity_block[block_size];
-    // this stores the xor of other survivng data disks
-    char other_blocks[block_size];
+    rebuilding_disk = disk_num;
+    rebuild_watermark = 0;
+    rebuild_count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &rebuild_started);
+}
 
-    for (int stripe = 0; stripe < blocks_per_disk; stripe++)
+/* Rebuild up to count stripes of the disk being rebuilt, starting at the
+ * watermark, from the other disks. If the disk has loaded a valid image,
+ * only the stripes marked in its write-intent bitmap are out of date and
+ * the others are passed over without counting. The stripes of a batch
+ * are read from every other disk at once, and then written together.
+ * Any failure is treated as catastrophic.
+ */
+static void rebuild_stripes(int count)
+{
+    int disk_num = rebuilding_disk;
+    int stripes = disk_size / block_size;
+
+    // for each stripe, the block from every surviving disk followed by
+    // the lost block
+    char *blocks = rebuild_data;
+    disk_io_t ios[REBUILD_BATCH * num_disks];
+    int batch[REBUILD_BATCH];
+    uint64_t started = stats_now();
+
+    int n = 0;
+    int next = rebuild_watermark;
+    while (n < count && next < stripes)
     {
-        memset(lost_disk_buffer, 0, block_size);
+        if (unit_stale(disk_num, next))
+        {
+            batch[n++] = next;
+        }
+        next++;
+    }
 
-        if (read_block_from_disk(stripe * num_disks, parity_block, 1) != 0)
+    int k = 0;
+    for (int b = 0; b < n; b++)
+    {
+        int m = 0;
+        for (int i = 0; i < num_disks + 1; i++)
         {
-            fprintf(stderr, "Failed to read parity disk at block %d\n", stripe);
-            exit(1);
+            if (i != disk_num)
+            {
+                ios[k++] = (disk_io_t){i, CMD_READ, batch[b],
+                                       &blocks[((size_t)b * (num_disks + 1) + m++) * block_size], 0, 0};
+            }
         }
+    }
+
+    // error check for if any read fails
+    if (do_units(ios, k) != 0)
+    {
+        fprintf(stderr, "Failed to read stripes %d-%d from surviving disks\n", rebuild_watermark, next - 1);
+        exit(1);
+    }
+
+    // Every stripe XORs to zero across all num_disks + 1 disks, whether a
+    // disk holds data or parity for that stripe, so the lost block is the
+    // XOR of the same stripe on every surviving disk. This works for both
+    // the RAID 4 and RAID 5 layouts.
+    for (int b = 0; b < n; b++)
+    {
+        char *stripe = &blocks[(size_t)b * (num_disks + 1) * block_size];
+        char *lost = &stripe[(size_t)num_disks * block_size];
 
+        memset(lost, 0, block_size);
         for (int i = 0; i < num_disks; i++)
         {
-            if (i != disk_num)
+            for (int j = 0; j < block_size; j++)
             {
-                // this calculates the exact block number, as distributed across the disks
-                int block_num = i + (stripe * num_disks);
+                lost[j] ^= stripe[(size_t)i * block_size + j];
+            }
+        }
+        ios[b] = (disk_io_t){disk_num, CMD_WRITE, batch[b], lost, 0, 0};
+    }
 
-                // error check for if read fails
-                if (read_block_from_disk(block_num, other_blocks, 0) != 0)
-                {
-                    fprintf(stderr, "Failed to read block %d\n", block_num);
-                    exit(1);
-                }
+    // finally we write them to the newly re-initalized disk
+    if (do_units(ios, n) != 0)
+    {
+        fprintf(stderr, "Failed to write recovered data for stripes %d-%d\n", rebuild_watermark, next - 1);
+        exit(1);
+    }
 
-                for (int j = 0; j < block_size; j++)
+    stats_op(STATS_REBUILD, (long)n * block_size, stats_now() - started);
+    rebuild_watermark = next;
+    rebuild_count += n;
+    if (rebuild_watermark == stripes)
+    {
+        if (rebuild_rate > 0)
+        {
+            fprintf(stderr, "Disk %d rebuilt\n", disk_num);
+        }
+        rebuilding_disk = -1;
+    }
+}
+
+/* Rebuild the rest of the disk being rebuilt, if there is one, without
+ * waiting for the rebuild rate.
+ */
+static void finish_rebuild()
+{
+    while (rebuilding_disk >= 0)
+    {
+        rebuild_stripes(REBUILD_BATCH);
+    }
+}
+
+/* Return the state of the disks: which disk is degraded or being
+ * rebuilt, and how far the rebuild has got.
+ */
+array_status_t array_status()
+{
+    array_status_t status = {degraded_disk, rebuilding_disk, rebuild_watermark, disk_size / block_size, 0};
+    for (int i = num_disks + 1; i < num_disks + 1 + spare_disks; i++)
+    {
+        status.spares += !controllers[i].failed;
+    }
+    return status;
+}
+
+/* Check count stripes from the scrub cursor on, reading each from every
+ * disk. The disks are read directly rather than through do_units, so
+ * that what is checked is what the disks hold and not a cached copy. A
+ * block that fails its checksum is repaired, and a stripe whose parity
+ * block does not match its data blocks gets its parity rewritten. If a
+ * disk fails, the scrub stops at that stripe until the disk is back.
+ */
+static void scrub_stripes(int count)
+{
+    int stripes = disk_size / block_size;
+    disk_io_t ios[SCRUB_BATCH * (num_disks + 1)];
+    char *expected = &scrub_data[(size_t)SCRUB_BATCH * (num_disks + 1) * block_size];
+
+    if (count > stripes)
+    {
+        count = stripes;
+    }
+
+    finish_prefetch();
+
+    int k = 0;
+    for (int b = 0; b < count; b++)
+    {
+        for (int i = 0; i < num_disks + 1; i++)
+        {
+            ios[k] = (disk_io_t){i, CMD_READ, (scrub_cursor + b) % stripes,
+                                 &scrub_data[(size_t)k * block_size], 0, 0};
+            disk_submit(&ios[k]);
+            k++;
+        }
+    }
+    for (int j = 0; j < k; j++)
+    {
+        disk_complete(&ios[j]);
+    }
+
+    for (int b = 0; b < count; b++)
+    {
+        int stripe_num = (scrub_cursor + b) % stripes;
+        disk_io_t *stripe = &ios[b * (num_disks + 1)];
+
+        for (int i = 0; i < num_disks + 1; i++)
+        {
+            if (stripe[i].status == STATUS_BAD_CHECKSUM)
+            {
+                stripe[i].status = repair_unit(i, stripe_num, stripe[i].data);
+            }
+            if (stripe[i].status != 0)
+            {
+                if (controllers[i].failed)
                 {
-                    lost_disk_buffer[j] ^= other_blocks[j];
+                    degrade_disk(i);
                 }
+                scrub_cursor = stripe_num;
+                return;
             }
         }
 
-        for (int j = 0; j < block_size; j++)
+        // the parity block is the XOR of the data blocks
+        int parity = parity_disk(stripe_num);
+        memset(expected, 0, block_size);
+        for (int i = 0; i < num_disks + 1; i++)
         {
-            lost_disk_buffer[j] ^= parity_block[j];
+            if (i == parity)
+            {
+                continue;
+            }
+            for (int j = 0; j < block_size; j++)
+            {
+                expected[j] ^= stripe[i].data[j];
+            }
         }
-
-        int block_num = disk_num + (stripe * num_disks);
-
-        if (write_block_to_disk(block_num, lost_disk_buffer, 0) != 0)
+        if (memcmp(expected, stripe[parity].data, block_size) != 0)
         {
-            fprintf(stderr, "Failed to write recovered data for block %d\n", block_num);
-            exit(1);
+            fprintf(stderr, "Stripe %d: parity does not match the data, rewriting it\n", stripe_num);
+            if (write_unit(parity, stripe_num, expected) == 0)
+            {
+                scrub_counts.parity_repairs++;
+            }
         }
+        scrub_counts.stripes++;
     }
 
-    // finally we write it to the newly re-initalized disk
+    scrub_cursor = (scrub_cursor + count) % stripes;
+    scrub_count += count;
+}
+
+/* Return the counters of the background scrub and of checksum repairs.
+ */
+scrub_stats_t scrub_stats()
+{
+    return scrub_counts;
 }
@@ -0,0 +1,130 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdint.h>
+#include <string.h>
+#include "raid.h"
+
+/*
+ * This file computes the CRC32C (Castagnoli) checksums that the disks keep
+ * for their blocks. On x86-64 processors with SSE4.2 the crc32 instruction
+ * is used; elsewhere the checksum is computed eight bytes at a time with
+ * the slice-by-8 tables.
+ */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32_INSTRUCTION
+#endif
+
+// The CRC32C polynomial, bit-reversed
+#define CRC32C_POLY 0x82F63B78
+
+// table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t table[8][256];
+
+static uint32_t (*update)(uint32_t crc, const unsigned char *data, size_t length);
+
+/* Continue the CRC crc over length bytes at data with the slice-by-8
+ * tables.
+ */
+static uint32_t update_tables(uint32_t crc, const unsigned char *data, size_t length)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (length >= 8)
+    {
+        uint32_t low, high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+              table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+              table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+              table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+#endif
+    while (length-- > 0)
+    {
+        crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef HAVE_CRC32_INSTRUCTION
+/* Continue the CRC crc over length bytes at data with the SSE4.2 crc32
+ * instruction.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t update_instruction(uint32_t crc, const unsigned char *data, size_t length)
+{
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (length-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+/* Choose how checksums are computed, building the tables if they are
+ * needed.
+ */
+static void crc32c_init()
+{
+#ifdef HAVE_CRC32_INSTRUCTION
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        update = update_instruction;
+        return;
+    }
+#endif
+
+    for (int b = 0; b < 256; b++)
+    {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        table[0][b] = crc;
+    }
+    for (int b = 0; b < 256; b++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+        }
+    }
+    update = update_tables;
+}
+
+/* Return the CRC32C checksum of the length bytes at data.
+ */
+uint32_t crc32c(const void *data, size_t length)
+{
+    if (!update)
+    {
+        crc32c_init();
+    }
+    return ~update(~0U, data, length);
+}
@@ -14,29 +14,756 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "raid.h"
 
 int debug = 1; // Set to 1 to enable debug output, 0 to disable
 
-static int checkpoint_disk(char *disk_data, int id); // forward declaration
+int disk_mmap = 0;           // Set to 1 to map disk_N.dat instead of holding the disk in memory
+int checkpoint_interval = 0; // Seconds between periodic checkpoints, 0 to disable
 
-/*
- * Main function for the disk simulation process, which runs in a child process
- * created by the RAID controller.
+// State of this disk process: one bit per stripe written since the last
+// checkpoint, and the image file, which stays open so that checkpoints
+// can write just the dirty blocks in place
+static unsigned char *dirty;
+static int image_fd = -1;
+
+// The CRC32C checksum of every block, checked whenever the block is read.
+// They are saved in the disk's checksum file at each checkpoint, next to
+// the image, so that a block that has changed on its own since it was
+// written is noticed rather than returned.
+static uint32_t *checksums;
+static int checksum_fd = -1;
+
+// A request taken from the parent that has not been serviced yet
+typedef struct
+{
+    disk_request_t req;
+    char *payload;         // block carried by a write
+    unsigned long arrival; // order in which requests arrived
+    int used;
+    int cancelled;         // set by CMD_CANCEL
+} queued_request_t;
+
+// Requests waiting to be serviced. The parent never has more than
+// queue_depth outstanding, plus a final CMD_EXIT.
+static queued_request_t *queue;
+static int queue_capacity;
+static int queued;
+static unsigned long arrivals;
+// Stripe of the last request serviced, where the elevator sweep resumes
+static int head;
+
+// Named service-time models for disk_model_parse
+static const struct
+{
+    const char *name;
+    disk_model_t model;
+} profiles[] = {
+    {"memory", {0, 0, 0, 0, 0, 0, 0}},
+    // a 7200 rpm disk: 15 ms full seek, 4.2 ms average rotation, 150 MB/s
+    {"hdd", {100, 100, 15000, 4170, 150, 0, 0}},
+    // a SATA flash disk, where 1 write in 100 waits 5 ms for garbage collection
+    {"ssd", {80, 25, 0, 0, 500, 1, 5000}},
+};
+
+// A model set for one disk only
+typedef struct
+{
+    int disk;
+    disk_model_t model;
+} disk_override_t;
+
+static disk_model_t default_model;
+static disk_override_t *overrides;
+static int num_overrides;
+
+// The model of this disk process, and whether it costs anything at all
+static disk_model_t model;
+static int modeled;
+static unsigned int model_seed;
+
+/* Store the name of disk id's file with the given extension, "dat" for
+ * the image or "crc" for the checksums, in disk_name, which has room for
+ * size bytes.
  *
- * id is the disk number or index into the controllers table,
- * to_parent is the pipe descriptor for writing to the parent,
- * from_parent is the pipe descriptor for reading from the parent.
+ * Returns 0 on success and -1 if the name does not fit.
+ */
+static int disk_file_name(char *disk_name, size_t size, int id, const char *extension)
+{
+    if (snprintf(disk_name, size, "disk_%d.%s", id, extension) >= (int)size)
+    {
+        fprintf(stderr, "Error: Disk name too long for disk %d\n", id);
+        return -1;
+    }
+    return 0;
+}
+
+/* Load the image file into the disk_size bytes at disk_data.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int load_disk_image(char *disk_data)
+{
+    size_t total = 0;
+    while (total < (size_t)disk_size)
+    {
+        ssize_t n = pread(image_fd, disk_data + total, disk_size - total, total);
+        if (n <= 0)
+        {
+            fprintf(stderr, "Error: Disk image is too short\n");
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+/* Write length bytes from buf to the file fd at offset.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int pwrite_full(int fd, const void *buf, size_t length, off_t offset)
+{
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t n = pwrite(fd, (const char *)buf + written, length - written, offset + written);
+        if (n < 0)
+        {
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+/* Open the checksum file of disk id, whose data is at disk_data, and set
+ * up the checksum of every block. If load_image is set, the checksums
+ * saved with the image are loaded, and those of any blocks that the file
+ * does not cover are computed from the image. Otherwise every block is
+ * zeroed, and the file is rewritten to match.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int open_checksums(int id, int load_image, char *disk_data)
+{
+    int stripes = disk_size / block_size;
+    checksums = malloc(stripes * sizeof(*checksums));
+    if (!checksums)
+    {
+        perror("Failed to allocate block checksums");
+        return -1;
+    }
+
+    char checksum_name[MAX_NAME];
+    if (disk_file_name(checksum_name, sizeof(checksum_name), id, "crc") != 0)
+    {
+        return -1;
+    }
+
+    checksum_fd = open(checksum_name, O_RDWR | O_CREAT, 0644);
+    if (checksum_fd < 0)
+    {
+        perror("Failed to open checksum file");
+        return -1;
+    }
+
+    int loaded = 0;
+    if (load_image)
+    {
+        ssize_t n = pread(checksum_fd, checksums, stripes * sizeof(*checksums), 0);
+        loaded = n > 0 ? n / sizeof(*checksums) : 0;
+    }
+
+    // a disk that starts zeroed has the same checksum in every block
+    uint32_t zero_checksum = crc32c(disk_data, block_size);
+    for (int stripe = loaded; stripe < stripes; stripe++)
+    {
+        checksums[stripe] = load_image ? crc32c(&disk_data[(size_t)stripe * block_size], block_size)
+                                       : zero_checksum;
+    }
+
+    if (pwrite_full(checksum_fd, &checksums[loaded], (stripes - loaded) * sizeof(*checksums),
+                    loaded * sizeof(*checksums)) != 0 ||
+        ftruncate(checksum_fd, stripes * sizeof(*checksums)) != 0)
+    {
+        perror("Failed to write checksum file");
+        return -1;
+    }
+    return 0;
+}
+
+/* Allocate the storage for disk id. If load_image is set, the disk
+ * starts with the contents of its image file; otherwise the disk and
+ * its image file both start zeroed, so that the image only ever needs
+ * the blocks written since the last checkpoint.
+ *
+ * If disk_mmap is set, the disk's image file is mapped shared, so every
+ * write lands in the page cache of disk_N.dat and a checkpoint only has
+ * to flush the dirty pages. Otherwise the disk is held in heap memory
+ * and checkpoint_disk writes the dirty blocks back to the image, which
+ * is held in memory if it is not NULL (disk_size zeroed bytes) and in a
+ * new allocation otherwise. Either way, the blocks' checksums are set up
+ * by open_checksums.
+ *
+ * Returns a pointer to the disk's data, or NULL on failure.
+ */
+static char *open_disk_data(int id, int load_image, char *memory)
+{
+    dirty = calloc((disk_size / block_size + 7) / 8, 1);
+    if (!dirty)
+    {
+        perror("Failed to allocate dirty block map");
+        return NULL;
+    }
+
+    char disk_name[MAX_NAME];
+    if (disk_file_name(disk_name, sizeof(disk_name), id, "dat") != 0)
+    {
+        return NULL;
+    }
+
+    image_fd = open(disk_name, O_RDWR | O_CREAT, 0644);
+    if (image_fd < 0)
+    {
+        perror("Failed to open disk image");
+        return NULL;
+    }
+
+    // Truncating to 0 first discards any old contents, so the disk
+    // starts zeroed just like a freshly allocated one
+    if ((!load_image && ftruncate(image_fd, 0) != 0) || ftruncate(image_fd, disk_size) != 0)
+    {
+        perror("Failed to size disk image");
+        return NULL;
+    }
+
+    char *disk_data;
+    if (!disk_mmap)
+    {
+        disk_data = memory ? memory : calloc(disk_size, 1);
+        if (!disk_data)
+        {
+            perror("Failed to allocate memory for disk");
+            return NULL;
+        }
+        if (load_image && load_disk_image(disk_data) != 0)
+        {
+            if (!memory)
+            {
+                free(disk_data);
+            }
+            return NULL;
+        }
+    }
+    else
+    {
+        disk_data = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+        // the mapping keeps the file open
+        close(image_fd);
+        image_fd = -1;
+        if (disk_data == MAP_FAILED)
+        {
+            perror("Failed to map disk image");
+            return NULL;
+        }
+    }
+
+    if (open_checksums(id, load_image, disk_data) != 0)
+    {
+        return NULL;
+    }
+    return disk_data;
+}
+
+/* Record that stripe_num has been written since the last checkpoint.
+ */
+static void mark_dirty(int stripe_num)
+{
+    dirty[stripe_num / 8] |= 1 << (stripe_num % 8);
+}
+
+/* Return 1 if stripe_num has been written since the last checkpoint.
+ */
+static int is_dirty(int stripe_num)
+{
+    return (dirty[stripe_num / 8] >> (stripe_num % 8)) & 1;
+}
+
+/* Save the blocks of the disk's data, pointed to by disk_data, that have
+ * been written since the last checkpoint to the image file of disk id,
+ * and their checksums to its checksum file. Consecutive dirty blocks are
+ * written with a single pwrite, as are their checksums. With disk_mmap
+ * the kernel tracks the dirty pages, so msync flushes them.
+ *
+ * Returns 0 on success, and -1 on failure.
+ */
+static int checkpoint_disk(char *disk_data, int id)
+{
+    if (!disk_data)
+    {
+        fprintf(stderr, "Error: Invalid parameters for checkpoint\n");
+        return -1;
+    }
+
+    if (disk_mmap && msync(disk_data, disk_size, MS_SYNC) != 0)
+    {
+        perror("Failed to sync disk image");
+        return -1;
+    }
+
+    int stripes = disk_size / block_size;
+    int stripe = 0;
+    while (stripe < stripes)
+    {
+        if (!is_dirty(stripe))
+        {
+            stripe++;
+            continue;
+        }
+
+        // find the end of this run of dirty blocks
+        int end = stripe;
+        while (end < stripes && is_dirty(end))
+        {
+            end++;
+        }
+
+        // a mapped image already holds the blocks
+        size_t offset = (size_t)stripe * block_size;
+        size_t length = (size_t)(end - stripe) * block_size;
+        if ((!disk_mmap && pwrite_full(image_fd, disk_data + offset, length, offset) != 0) ||
+            pwrite_full(checksum_fd, &checksums[stripe], (end - stripe) * sizeof(*checksums),
+                        stripe * sizeof(*checksums)) != 0)
+        {
+            fprintf(stderr, "[%d] ", id);
+            perror("Failed to write checkpoint data");
+            return -1;
+        }
+
+        stripe = end;
+    }
+
+    memset(dirty, 0, (stripes + 7) / 8);
+    return 0;
+}
+
+/* Return the number of milliseconds from now until the time when.
+ */
+static int ms_until(struct timespec *when)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long ms = (when->tv_sec - now.tv_sec) * 1000 + (when->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+/* Set the service-time model of the disks from spec, which is a list of
+ * comma-separated settings: the name of a model in profiles, which sets
+ * every field, or field=value, which sets one of read, write, seek,
+ * rotation, tail_latency (in microseconds), bandwidth (in MB/s) or tail
+ * (a percentage of writes). Settings start from the model for every
+ * disk, and apply to it, unless spec begins with a disk number and a
+ * colon, in which case they apply to that disk only. Specs are applied
+ * in order.
+ *
+ * Returns 0 on success and -1 if spec is malformed.
+ */
+int disk_model_parse(char *spec)
+{
+    int disk = -1;
+    char *settings = strchr(spec, ':');
+    if (settings)
+    {
+        char *end;
+        disk = strtol(spec, &end, 10);
+        if (end != settings || end == spec || disk < 0)
+        {
+            fprintf(stderr, "Error: Invalid disk number in disk model %s\n", spec);
+            return -1;
+        }
+        settings++;
+    }
+    else
+    {
+        settings = spec;
+    }
+
+    disk_model_t m = default_model;
+    char *copy = strdup(settings);
+    if (!copy)
+    {
+        perror("Failed to parse disk model");
+        return -1;
+    }
+
+    int status = 0;
+    char *save;
+    for (char *s = strtok_r(copy, ",", &save); s && status == 0; s = strtok_r(NULL, ",", &save))
+    {
+        char *value = strchr(s, '=');
+        if (!value)
+        {
+            status = -1;
+            for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+            {
+                if (strcmp(s, profiles[i].name) == 0)
+                {
+                    m = profiles[i].model;
+                    status = 0;
+                }
+            }
+            if (status != 0)
+            {
+                fprintf(stderr, "Error: Unknown disk model %s\n", s);
+            }
+            continue;
+        }
+
+        *value++ = '\0';
+        char *end;
+        double number = strtod(value, &end);
+        int *field = strcmp(s, "read") == 0          ? &m.read_us
+                     : strcmp(s, "write") == 0        ? &m.write_us
+                     : strcmp(s, "seek") == 0         ? &m.seek_us
+                     : strcmp(s, "rotation") == 0     ? &m.rotation_us
+                     : strcmp(s, "bandwidth") == 0    ? &m.bandwidth
+                     : strcmp(s, "tail_latency") == 0 ? &m.tail_us
+                                                      : NULL;
+        if (*end != '\0' || end == value || number < 0 ||
+            (!field && strcmp(s, "tail") != 0) || (!field && number > 100))
+        {
+            fprintf(stderr, "Error: Invalid disk model setting %s=%s\n", s, value);
+            status = -1;
+        }
+        else if (field)
+        {
+            *field = (int)number;
+        }
+        else
+        {
+            m.tail_percent = number;
+        }
+    }
+    free(copy);
+    if (status != 0)
+    {
+        return -1;
+    }
+
+    if (disk < 0)
+    {
+        default_model = m;
+        return 0;
+    }
+    disk_override_t *grown = realloc(overrides, (num_overrides + 1) * sizeof(*overrides));
+    if (!grown)
+    {
+        perror("Failed to parse disk model");
+        return -1;
+    }
+    overrides = grown;
+    overrides[num_overrides].disk = disk;
+    overrides[num_overrides].model = m;
+    num_overrides++;
+    return 0;
+}
+
+/* Make disk id's model the model of this process.
+ */
+static void choose_model(int id)
+{
+    model = default_model;
+    for (int i = 0; i < num_overrides; i++)
+    {
+        if (overrides[i].disk == id)
+        {
+            model = overrides[i].model;
+        }
+    }
+    disk_model_t none = profiles[0].model;
+    modeled = memcmp(&model, &none, sizeof(model)) != 0;
+    model_seed = id + 1;
+}
+
+/* Keep the disk busy for as long as its model takes to carry out the
+ * request cmd for stripe_num, out of stripes on the disk, with the head
+ * starting at the stripe of the last request serviced.
+ */
+static void model_service(disk_command_t cmd, int stripe_num, int stripes)
+{
+    if (!modeled)
+    {
+        return;
+    }
+
+    // an XOR write reads the block and writes it back, and so costs what
+    // a read and a write of the same stripe would
+    uint64_t ns = (uint64_t)(cmd == CMD_READ    ? model.read_us
+                             : cmd == CMD_WRITE ? model.write_us
+                                                : model.read_us + model.write_us) * 1000;
+    if (cmd == CMD_XOR_WRITE)
+    {
+        ns += (uint64_t)model.rotation_us * 1000;
+    }
+    // the stripe after the last one is already under the head
+    if (stripe_num != head + 1)
+    {
+        double distance = abs(stripe_num - head) / (double)stripes;
+        ns += (uint64_t)(model.seek_us * 1000 * sqrt(distance)) + (uint64_t)model.rotation_us * 1000;
+    }
+    if (model.bandwidth > 0)
+    {
+        ns += (uint64_t)block_size * 1000 / model.bandwidth;
+    }
+    if (cmd != CMD_READ && model.tail_percent > 0 &&
+        rand_r(&model_seed) < model.tail_percent / 100 * RAND_MAX)
+    {
+        ns += (uint64_t)model.tail_us * 1000;
+    }
+
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += ns / 1000000000;
+    until.tv_nsec += ns % 1000000000;
+    if (until.tv_nsec >= 1000000000)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+    {
+    }
+}
+
+/* XOR the block at delta into the block at block, a word at a time when
+ * both are aligned for it.
+ */
+static void xor_block(char *block, const char *delta)
+{
+    int i = 0;
+    if (((uintptr_t)block | (uintptr_t)delta) % sizeof(uint64_t) == 0)
+    {
+        for (; i + (int)sizeof(uint64_t) <= block_size; i += sizeof(uint64_t))
+        {
+            *(uint64_t *)(block + i) ^= *(const uint64_t *)(delta + i);
+        }
+    }
+    for (; i < block_size; i++)
+    {
+        block[i] ^= delta[i];
+    }
+}
+
+/* Read exactly size bytes from the pipe descriptor fd into buf. A block
+ * larger than the pipe's capacity arrives in several pieces.
+ *
+ * Returns size on success, or the short count if the pipe was closed
+ * or the read failed.
+ */
+static ssize_t read_full(int fd, void *buf, size_t size)
+{
+    size_t total = 0;
+    while (total < size)
+    {
+        ssize_t n = read(fd, (char *)buf + total, size - total);
+        if (n <= 0)
+        {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/* Write exactly size bytes from buf to the pipe descriptor fd.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int write_full(int fd, const void *buf, size_t size)
+{
+    size_t total = 0;
+    while (total < size)
+    {
+        ssize_t n = write(fd, (const char *)buf + total, size - total);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+/* Allocate the request queue, with a payload buffer for every entry so
+ * that taking a request never allocates.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int init_queue()
+{
+    queue_capacity = queue_depth + 1;
+    queue = calloc(queue_capacity, sizeof(*queue));
+    if (!queue)
+    {
+        perror("Failed to allocate request queue");
+        return -1;
+    }
+    for (int i = 0; i < queue_capacity; i++)
+    {
+        queue[i].payload = malloc(block_size);
+        if (!queue[i].payload)
+        {
+            perror("Failed to allocate request queue");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Read the next request from the pipe from_parent into a free queue
+ * entry. The block of a write sent through the pipe is read with it;
+ * with shared memory it stays in the request's slot until serviced.
+ *
+ * Returns 0 on success and -1 if the pipe was closed or the request
+ * was malformed.
+ */
+static int receive_request(int id, int from_parent)
+{
+    queued_request_t *q = queue;
+    while (q->used)
+    {
+        q++;
+    }
+
+    if (read_full(from_parent, &q->req, sizeof(q->req)) != sizeof(q->req))
+    {
+        fprintf(stderr, "[%d] Error reading command\n", id);
+        return -1;
+    }
+    if (q->req.length > 0 &&
+        (q->req.length != block_size ||
+         read_full(from_parent, q->payload, block_size) != (ssize_t)block_size))
+    {
+        fprintf(stderr, "[%d] Error reading block data from parent\n", id);
+        return -1;
+    }
+
+    // a cancel is not queued: it marks the read it names, if that is
+    // still waiting, to be answered at once without being served
+    if (q->req.cmd == CMD_CANCEL)
+    {
+        for (int i = 0; i < queue_capacity; i++)
+        {
+            if (queue[i].used && queue[i].req.tag == q->req.tag && queue[i].req.cmd == CMD_READ)
+            {
+                queue[i].cancelled = 1;
+            }
+        }
+        return 0;
+    }
+    q->cancelled = 0;
+
+    q->arrival = arrivals++;
+    q->used = 1;
+    queued++;
+    return 0;
+}
+
+/* Choose the next queued request to service. Reads and writes are taken
+ * in elevator order: the request with the lowest stripe at or after the
+ * head, wrapping around to the lowest stripe once the sweep passes the
+ * last one. Requests for the same stripe keep their arrival order. Any
+ * other command is a barrier: the requests that arrived before it are
+ * serviced first, and none that arrived after it are serviced until it
+ * has been. A cancelled read goes first, since it costs nothing.
+ *
+ * Returns the chosen request.
+ */
+static queued_request_t *next_request()
+{
+    for (int i = 0; i < queue_capacity; i++)
+    {
+        if (queue[i].used && queue[i].cancelled)
+        {
+            return &queue[i];
+        }
+    }
+
+    queued_request_t *barrier = NULL;
+    for (int i = 0; i < queue_capacity; i++)
+    {
+        queued_request_t *q = &queue[i];
+        if (q->used && q->req.cmd != CMD_READ && q->req.cmd != CMD_WRITE && q->req.cmd != CMD_XOR_WRITE &&
+            (!barrier || q->arrival < barrier->arrival))
+        {
+            barrier = q;
+        }
+    }
+
+    queued_request_t *ahead = NULL;  // best at or after the head
+    queued_request_t *behind = NULL; // best before the head
+    for (int i = 0; i < queue_capacity; i++)
+    {
+        queued_request_t *q = &queue[i];
+        if (!q->used || q == barrier || (barrier && q->arrival > barrier->arrival))
+        {
+            continue;
+        }
+
+        queued_request_t **best = q->req.stripe_num >= head ? &ahead : &behind;
+        if (!*best || q->req.stripe_num < (*best)->req.stripe_num ||
+            (q->req.stripe_num == (*best)->req.stripe_num && q->arrival < (*best)->arrival))
+        {
+            *best = q;
+        }
+    }
+
+    if (ahead)
+    {
+        return ahead;
+    }
+    return behind ? behind : barrier;
+}
+
+/* Send the reply to a request to the parent: the request's tag and
+ * status, followed by data if it is not NULL.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int send_reply(int id, int to_parent, unsigned int tag, int status, char *data)
+{
+    disk_reply_t reply = {tag, status, data ? block_size : 0};
+    if (write_full(to_parent, &reply, sizeof(reply)) != 0 ||
+        (data && write_full(to_parent, data, block_size) != 0))
+    {
+        fprintf(stderr, "[%d] Error writing reply to parent\n", id);
+        return -1;
+    }
+    return 0;
+}
+
+/* Serve the requests from the parent for disk id, whose data is at
+ * disk_data, until CMD_EXIT is received or the parent goes away.
  *
  * Returns 0 on success and 1 on failure.
  */
-int start_disk(int id, int to_parent, int from_parent)
+static int serve_disk(int id, int to_parent, int from_parent, char *shm, char *disk_data)
 {
     int status = 0;
+    int stripes = disk_size / block_size;
 
-    // Allocate memory for disk data
-    char disk_data[disk_size];
-    memset(disk_data, 0, disk_size);
+    struct timespec next_checkpoint;
+    clock_gettime(CLOCK_MONOTONIC, &next_checkpoint);
+    next_checkpoint.tv_sec += checkpoint_interval;
+    choose_model(id);
 
     if (debug)
     {
@@ -48,105 +775,198 @@ int start_disk(int id, int to_parent, int from_parent)
     // an exit command is received.
     while (1)
     {
-        disk_command_t cmd;
+        if (checkpoint_interval > 0 && ms_until(&next_checkpoint) == 0)
+        {
+            uint64_t started = tracing() ? stats_now() : 0;
+            if (checkpoint_disk(disk_data, id) != 0)
+            {
+                fprintf(stderr, "[%d] Error during periodic checkpoint\n", id);
+            }
+            trace_event(TRACE_CHECKPOINT, id, -1, started);
+            next_checkpoint.tv_sec += checkpoint_interval;
+        }
 
-        // Read command through the pipe from the parent
-        ssize_t cmd_return = read(from_parent, &cmd, sizeof(cmd));
+        // With nothing queued, wait for the next request; with a
+        // checkpoint interval, wait only until the next checkpoint is due
+        if (queued == 0)
+        {
+            struct pollfd pfd = {from_parent, POLLIN, 0};
+            int timeout = checkpoint_interval > 0 ? ms_until(&next_checkpoint) : -1;
+            if (poll(&pfd, 1, timeout) == 0)
+            {
+                continue;
+            }
+            if (receive_request(id, from_parent) != 0)
+            {
+                status = 1;
+                break;
+            }
+        }
 
-        // if read fails
-        if (cmd_return != sizeof(cmd))
+        // Take every request that has already arrived, so the elevator
+        // has the whole queue to choose from
+        struct pollfd pfd = {from_parent, POLLIN, 0};
+        while (queued < queue_capacity && poll(&pfd, 1, 0) > 0)
+        {
+            if (receive_request(id, from_parent) != 0)
+            {
+                status = 1;
+                break;
+            }
+        }
+        if (status)
         {
-            fprintf(stderr, "[%d] Error reading command\n", id);
-            status = 1;
             break;
         }
+        if (queued == 0)
+        {
+            continue;
+        }
+
+        queued_request_t *q = next_request();
+        disk_request_t *req = &q->req;
+        q->used = 0;
+        queued--;
+        uint64_t started = tracing() ? stats_now() : 0;
+        if (q->cancelled)
+        {
+            if (send_reply(id, to_parent, req->tag, STATUS_CANCELLED, NULL) != 0)
+            {
+                status = 1;
+                break;
+            }
+            continue;
+        }
+
+        int stripe_num = req->stripe_num;
+        int block_request = req->cmd == CMD_READ || req->cmd == CMD_WRITE || req->cmd == CMD_XOR_WRITE;
+        if (block_request &&
+            (stripe_num < 0 || stripe_num >= stripes ||
+             (shm && req->tag >= (unsigned int)queue_depth)))
+        {
+            fprintf(stderr, "[%d] Invalid request for block %d\n", id, stripe_num);
+            if (send_reply(id, to_parent, req->tag, -1, NULL) != 0)
+            {
+                status = 1;
+                break;
+            }
+            continue;
+        }
+        if (block_request)
+        {
+            model_service(req->cmd, stripe_num, stripes);
+        }
 
         // The type of command received from the parent
         // determines which action is taken next.
-        switch (cmd)
+        switch (req->cmd)
         {
         case CMD_READ:
         {
-            // TODO: Handle READs
+            head = stripe_num;
 
-            // We first need to read the stripe number from the parent process
-            int stripe_num;
-            ssize_t bytes_read = read(from_parent, &stripe_num, sizeof(stripe_num));
-            if (bytes_read != sizeof(stripe_num))
+            char *block = &disk_data[(size_t)stripe_num * block_size];
+
+            // a block that has changed since it was written is not returned
+            if (crc32c(block, block_size) != checksums[stripe_num])
             {
-                fprintf(stderr, "[%d] Error reading stripe number\n", id);
-                status = 1;
+                fprintf(stderr, "[%d] Block %d does not match its checksum\n", id, stripe_num);
+                if (send_reply(id, to_parent, req->tag, STATUS_BAD_CHECKSUM, NULL) != 0)
+                {
+                    status = 1;
+                }
                 break;
             }
 
-            // debug message
-            if (debug)
+            // With shared memory, the block is copied into the request's
+            // slot, and only the reply header goes through the pipe
+            if (shm)
             {
-                printf("[%d] cmd: %d. Block num: %d, size: %d\n", id, CMD_READ, stripe_num, block_size);
-                printf("[%d] Writing data to parent. Block num: %d\n", id, stripe_num);
+                memcpy(&shm[(size_t)req->tag * block_size], block, block_size);
+                block = NULL;
             }
 
-            // Then, we return the block data, by indexing disk_data at the stripe location
-            ssize_t bytes_written = write(to_parent, &disk_data[stripe_num * block_size], block_size);
-            if (bytes_written != block_size)
+            if (send_reply(id, to_parent, req->tag, 0, block) != 0)
             {
-                fprintf(stderr, "[%d] Error writing block data to parent\n", id);
                 status = 1;
-                break;
             }
-
+            trace_event(TRACE_READ, id, stripe_num, started);
             break;
         }
 
         case CMD_WRITE:
         {
-            // TODO: Handle WRITEs
+            head = stripe_num;
+
+            // the block came with the request, or is waiting in its slot
+            char *block = shm ? &shm[(size_t)req->tag * block_size] : q->payload;
+            memcpy(&disk_data[(size_t)stripe_num * block_size], block, block_size);
+            checksums[stripe_num] = crc32c(block, block_size);
+            mark_dirty(stripe_num);
 
-            // We first need to read the stripe number from the parent process
-            int stripe_num;
-            ssize_t bytes_read = read(from_parent, &stripe_num, sizeof(stripe_num));
-            if (bytes_read != sizeof(stripe_num))
+            if (send_reply(id, to_parent, req->tag, 0, NULL) != 0)
             {
-                fprintf(stderr, "[%d] Error reading stripe number\n", id);
                 status = 1;
-                break;
             }
+            trace_event(TRACE_WRITE, id, stripe_num, started);
+            break;
+        }
 
-            // Debug message
-            if (debug)
+        case CMD_XOR_WRITE:
+        {
+            head = stripe_num;
+
+            // the block is changed in place, so one that no longer
+            // matches its checksum is left for the parent to repair
+            char *stored = &disk_data[(size_t)stripe_num * block_size];
+            int reply = 0;
+            if (crc32c(stored, block_size) != checksums[stripe_num])
+            {
+                fprintf(stderr, "[%d] Block %d does not match its checksum\n", id, stripe_num);
+                reply = STATUS_BAD_CHECKSUM;
+            }
+            else
             {
-                printf("[%d] Read block from pipe. Block num: %d, size: %d\n", id, stripe_num, block_size);
-                printf("[%d] Writing data to disk. Block num: %d, size: %d\n", id, stripe_num, block_size);
+                xor_block(stored, shm ? &shm[(size_t)req->tag * block_size] : q->payload);
+                checksums[stripe_num] = crc32c(stored, block_size);
+                mark_dirty(stripe_num);
             }
 
-            // We then need to read the actual block data to be written;
-            // calculate where in the disk_data array this block should be stored
-            char *block_storage_location = &disk_data[stripe_num * block_size];
+            if (send_reply(id, to_parent, req->tag, reply, NULL) != 0)
+            {
+                status = 1;
+            }
+            trace_event(TRACE_XOR_WRITE, id, stripe_num, started);
+            break;
+        }
 
-            // read the block data from the parent process through the pipe
-            // and store it into the calculated location in disk_data
-            ssize_t bytes_read_from_parent = read(from_parent, block_storage_location, block_size);
+        case CMD_CHECKPOINT:
+        {
+            // Write the dirty blocks to the image and tell the parent
+            // whether the image is now up to date
+            int reply = checkpoint_disk(disk_data, id);
+            if (reply != 0)
+            {
+                fprintf(stderr, "[%d] Error when checkpointing disk\n", id);
+            }
+            trace_event(TRACE_CHECKPOINT, id, -1, started);
 
-            // erorr checking to see if we received the expected amount of data
-            if (bytes_read_from_parent != block_size)
+            if (send_reply(id, to_parent, req->tag, reply, NULL) != 0)
             {
-                fprintf(stderr, "[%d] Error reading block data from parent\n", id);
                 status = 1;
-                break;
             }
             break;
         }
 
         case CMD_EXIT:
         {
-            // TODO: Handle EXITs
-
             // before we exit, we need to first checkpoint the disk
             if (checkpoint_disk(disk_data, id) != 0)
             {
                 fprintf(stderr, "[%d] Error when checkpointing disk\n", id);
                 status = 1;
             }
+            trace_event(TRACE_CHECKPOINT, id, -1, started);
 
             if (debug)
             {
@@ -154,69 +974,119 @@ int start_disk(int id, int to_parent, int from_parent)
             }
 
             return status;
-            break;
+        }
 
         default:
-            fprintf(stderr, "Error: Unknown command %d received\n", cmd);
-            status = 1;
+            fprintf(stderr, "Error: Unknown command %d received\n", req->cmd);
+            if (send_reply(id, to_parent, req->tag, -1, NULL) != 0)
+            {
+                status = 1;
+            }
             break;
         }
+
+        if (status)
+        {
+            break;
         }
     }
 
-    // Checkpoint and cleanup before exiting
-    // TODO
+    return status;
+}
 
-    exit(status);
+/*
+ * Main function for the disk simulation process, which runs in a child process
+ * created by the RAID controller.
+ *
+ * id is the disk number or index into the controllers table,
+ * to_parent is the pipe descriptor for writing to the parent,
+ * from_parent is the pipe descriptor for reading from the parent,
+ * shm is the shared payload region, with one block slot per request tag,
+ * or NULL if payloads travel through the pipes,
+ * load_image is 1 if the disk starts with the contents of its image file.
+ *
+ * Requests are queued as they arrive and the queue is serviced in
+ * elevator order by stripe, so the parent can keep several requests
+ * outstanding on a disk at once. Every request except CMD_EXIT gets a
+ * reply carrying its tag.
+ *
+ * Returns 0 on success and 1 on failure.
+ */
+int start_disk(int id, int to_parent, int from_parent, char *shm, int load_image)
+{
+    // Allocate memory for disk data. This is on the heap (or mapped from
+    // the image file) so that the disk size is not limited by the stack.
+    char *disk_data = open_disk_data(id, load_image, NULL);
+    if (!disk_data || init_queue() != 0)
+    {
+        exit(1);
+    }
+
+    exit(serve_disk(id, to_parent, from_parent, shm, disk_data));
 }
 
-/* Save the disk's data, pointed to by disk_data, to a file named id.
+/*
+ * Main function for a hot-spare disk process. A spare is forked ahead of
+ * time and waits, with its memory already allocated, until the controller
+ * promotes it into the place of a failed disk with CMD_ASSIGN. The request
+ * carries the disk number as its stripe_num, followed by an int that is 1
+ * if the disk starts with the contents of its image file. The spare then
+ * replies and serves requests exactly like a disk started by start_disk.
  *
- * Returns 0 on success, and -1 on failure.
+ * to_parent, from_parent and shm are as for start_disk.
+ *
+ * Returns 0 if the spare was told to exit before being promoted, and
+ * otherwise does not return.
  */
-static int checkpoint_disk(char *disk_data, int id)
+int start_spare(int to_parent, int from_parent, char *shm)
 {
-    if (!disk_data)
+    // Touch every page now, so that neither the allocation nor the page
+    // faults are paid for when the spare takes over
+    char *memory = NULL;
+    if (!disk_mmap)
     {
-        fprintf(stderr, "Error: Invalid parameters for checkpoint\n");
-        return -1;
+        memory = malloc(disk_size);
+        if (!memory)
+        {
+            perror("Failed to allocate memory for spare disk");
+            exit(1);
+        }
+        memset(memory, 0, disk_size);
+    }
+    if (init_queue() != 0)
+    {
+        exit(1);
     }
 
-    // Create a file name for this disk
-    char disk_name[MAX_NAME];
-    if (snprintf(disk_name, sizeof(disk_name), "disk_%d.dat", id) >= (int)sizeof(disk_name))
+    disk_request_t req;
+    if (read_full(from_parent, &req, sizeof(req)) != sizeof(req))
     {
-        fprintf(stderr, "Error: Disk name too long for disk %d\n", id);
-        return 1;
+        exit(1);
+    }
+    if (req.cmd == CMD_EXIT)
+    {
+        return 0;
     }
 
-    FILE *fp = fopen(disk_name, "wb");
-    if (!fp)
+    int load_image;
+    if (req.cmd != CMD_ASSIGN || req.length != sizeof(load_image) ||
+        read_full(from_parent, &load_image, sizeof(load_image)) != sizeof(load_image))
     {
-        perror("Failed to create checkpoint file");
-        return -1;
+        fprintf(stderr, "Error: Spare disk received unexpected command %d\n", req.cmd);
+        exit(1);
     }
 
-    size_t bytes_written = fwrite(disk_data, 1, disk_size, fp);
-    if (bytes_written != (size_t)disk_size)
+    int id = req.stripe_num;
+    char *disk_data = open_disk_data(id, load_image, memory);
+    if (send_reply(id, to_parent, req.tag, disk_data ? 0 : -1, NULL) != 0 || !disk_data)
     {
-        if (ferror(fp))
-        {
-            fprintf(stderr, "Failed to write checkpoint data");
-        }
-        else
-        {
-            fprintf(stderr, "Error: Incomplete write during checkpoint\n");
-        }
-        fclose(fp);
-        return -1;
+        exit(1);
     }
 
-    if (fclose(fp) != 0)
+    if (debug)
     {
-        perror("Failed to close checkpoint file");
-        return -1;
+        printf("[%d] Promoted from hot spare\n", id);
     }
 
-    return 0;
+    exit(serve_disk(id, to_parent, from_parent, shm, disk_data));
 }
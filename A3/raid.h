@@ -13,50 +13,298 @@
 #ifndef RAID_H
 #define RAID_H
 
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 #define DEFAULT_NUM_DISKS 3
 #define DEFAULT_BLOCK_SIZE 16
 #define DEFAULT_DISK_SIZE (16 * DEFAULT_BLOCK_SIZE)
+#define DEFAULT_RAID_LEVEL 4
 
 #define MAX_NAME 32
 
+// Number of requests each disk can have outstanding at once
+#define DEFAULT_QUEUE_DEPTH 32
+#define MAX_QUEUE_DEPTH 256
+
+// Blocks held by the controller's block cache, 0 to disable it
+#define DEFAULT_CACHE_BLOCKS 0
+
+// Stripes held by the controller's write-back buffer, 0 to write through
+#define DEFAULT_WRITEBACK_STRIPES 0
+
+// Stripes rebuilt per second in the background, 0 to rebuild a restored
+// disk completely before carrying on
+#define DEFAULT_REBUILD_RATE 0
+
+// Idle disk processes kept ready to take the place of a failed disk
+#define DEFAULT_SPARE_DISKS 0
+
+// Stripes checked per second by the background scrub, 0 to disable it
+#define DEFAULT_SCRUB_RATE 0
+
+// Percentile of disk read latency after which a read is hedged with a
+// reconstruction from the rest of its stripe, 0 to disable hedging
+#define DEFAULT_HEDGE_PERCENTILE 0
+
+// Transports for block payloads between the controller and the disks
+#define TRANSPORT_PIPE 0
+#define TRANSPORT_SHM 1
+
+// Command types for disk processes
+typedef enum {
+    CMD_READ,
+    CMD_WRITE,
+    CMD_EXIT,
+    CMD_CHECKPOINT,
+    CMD_ASSIGN,             // Promote a hot spare to the disk in stripe_num
+    CMD_CANCEL,             // Drop the read with this tag if not yet served; no reply of its own
+    CMD_XOR_WRITE           // XOR the block sent into the block at stripe_num
+} disk_command_t;
+
+// Header sent to a disk in front of every request. With TRANSPORT_PIPE
+// the block of a CMD_WRITE or CMD_XOR_WRITE follows the header in the pipe; with
+// TRANSPORT_SHM blocks are exchanged through shared slot number tag.
+typedef struct {
+    unsigned int tag;       // Chosen by the controller, echoed in the reply
+    disk_command_t cmd;
+    int stripe_num;
+    int length;             // Bytes of payload following the header
+} disk_request_t;
+
+// Reply status of a read whose block does not match its checksum
+#define STATUS_BAD_CHECKSUM -2
+// Reply status of a read dropped by CMD_CANCEL before it was served
+#define STATUS_CANCELLED -3
+
+// Header sent back by a disk for every request except CMD_EXIT. Requests
+// may complete in any order, so the tag identifies the request.
+typedef struct {
+    unsigned int tag;
+    int status;             // 0 on success, -1 on failure, STATUS_BAD_CHECKSUM or STATUS_CANCELLED
+    int length;             // Bytes of payload following the header
+} disk_reply_t;
+
+// An asynchronous request to one disk, see disk_submit
+typedef struct {
+    int disk_num;
+    disk_command_t cmd;
+    int stripe_num;
+    char *data;             // Block to write, or where to store the block read
+    int status;             // 0 on success, -1 on failure, once done is set
+    int done;
+} disk_io_t;
+
 // Disk controller structure
 typedef struct {
     pid_t pid;
+    int pidfd;              // Readable once the process has exited, or -1
     int to_disk[2];         // Pipe for sending commands to disk
     int from_disk[2];       // Pipe for receiving responses from disk
+    char *shm;              // queue_depth shared block slots, or NULL for TRANSPORT_PIPE
+    disk_io_t **inflight;   // Outstanding requests, indexed by tag
+    uint64_t *issued;       // When each outstanding request was sent, indexed by tag
+    int outstanding;        // Number of outstanding requests
+    int abandoned;          // Of those, requests whose replies will be discarded
+    disk_io_t *orphans;     // What each abandoned request was, indexed by tag
+    int failed;             // Set once the disk has died, until it is restarted
 } disk_controller_t;
 
-// Command types for disk processes
+// Counters kept by the block cache
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long prefetched;    // Blocks read ahead of a sequential reader
+    unsigned long prefetch_hits; // Read-ahead blocks that were then used
+    unsigned long evictions;
+} cache_stats_t;
+
+// Counters kept by the write-back buffer
+typedef struct {
+    unsigned long blocks;       // Block writes taken into the buffer
+    unsigned long stripes;      // Stripes written out, one parity update each
+    unsigned long full_stripes; // Stripes written out without reading the disks
+} writeback_stats_t;
+
+// State of the disks, see array_status
+typedef struct {
+    int degraded_disk;   // Failed disk whose reads are reconstructed, or -1
+    int rebuilding_disk; // Restored disk being rebuilt, or -1
+    int watermark;       // Stripes below this have been rebuilt
+    int stripes;         // Stripes on each disk
+    int spares;          // Hot spares ready to take over a failed disk
+} array_status_t;
+
+// Counters kept by the background scrub and checksum repair
+typedef struct {
+    unsigned long stripes;        // Stripes checked by the scrub
+    unsigned long bad_checksums;  // Blocks read that failed their checksum
+    unsigned long repaired;       // Of those, blocks rebuilt from the other disks
+    unsigned long parity_repairs; // Parity blocks rewritten to match their data
+} scrub_stats_t;
+
+// Counters kept by hedged reads
+typedef struct {
+    unsigned long hedged; // Reads still unanswered at the deadline
+    unsigned long won;    // Of those, reads answered first by reconstruction
+    unsigned long diverted; // Reads reconstructed at once, their disk still busy with abandoned ones
+} hedge_stats_t;
+
+// One block read or write of a batch, see access_blocks
+typedef struct {
+    int block_num;
+    int write;              // 1 to write data to the block, 0 to read the block into data
+    char *data;
+    int status;             // 0 on success, -1 on failure
+} block_access_t;
+
+// Operations of the controller whose latency is kept, see stats_op
 typedef enum {
-    CMD_READ,
-    CMD_WRITE,
-    CMD_EXIT
-} disk_command_t;
+    STATS_READ,             // Reads of blocks of the array
+    STATS_FULL_STRIPE,      // Writes of whole stripes, with parity computed from the data
+    STATS_PARITY_UPDATE,    // Writes of part of a stripe, which read back data or parity
+    STATS_REBUILD,          // Batches of stripes rebuilt onto a restored disk
+    NUM_STATS_OPS
+} stats_op_t;
+
+// Binary traces, see trace.c: each traced process keeps a ring of the
+// last TRACE_EVENTS events in a file, which trace_decode reads
+#define TRACE_MAGIC 0x52414964
+#define TRACE_EVENTS (1 << 16)
+
+typedef enum {
+    TRACE_READ,             // A block read: by a disk, or a whole request seen by the controller
+    TRACE_WRITE,            // A block written, in the same way
+    TRACE_CHECKPOINT,       // A disk writing its dirty blocks to its image
+    TRACE_ARRAY_READ,       // The controller's operations, as in stats_op_t
+    TRACE_FULL_STRIPE,
+    TRACE_PARITY_UPDATE,
+    TRACE_REBUILD,
+    TRACE_FAIL,             // A disk found to have failed
+    TRACE_RESTORE,          // A failed disk replaced by a new process
+    TRACE_XOR_WRITE,        // A parity block updated in place by its disk
+    NUM_TRACE_OPS
+} trace_op_t;
+
+// The start of a trace file, followed by the ring of events
+typedef struct {
+    uint32_t magic;         // TRACE_MAGIC
+    uint32_t capacity;      // Events in the ring, a power of two
+    uint64_t next;          // Events recorded; the last capacity of them are kept
+    int32_t pid;
+    int32_t controller;     // 1 for the controller's trace, 0 for a disk's
+} trace_header_t;
+
+typedef struct {
+    uint64_t time;          // Nanoseconds on CLOCK_MONOTONIC when the event began
+    uint32_t duration;      // Nanoseconds it lasted, 0 for an instant
+    int32_t stripe;         // Stripe, or -1
+    int16_t disk;           // Disk, or -1
+    uint8_t op;             // trace_op_t
+} trace_event_t;
 
 // Command structure
 typedef struct {
     char *cmd;
     char *arg1;
     char *arg2;
+    char *arg3;
 } command_t;
 
+// Service-time model of a simulated disk, set with disk_model_parse. A
+// model of all zeroes is a disk that answers as fast as memory.
+typedef struct {
+    int read_us;         // fixed cost of every read
+    int write_us;        // fixed cost of every write
+    int seek_us;         // seek across the whole disk; shorter seeks cost the square root of the fraction
+    int rotation_us;     // average rotational delay, paid unless the stripe follows the last one
+    int bandwidth;       // transfer rate in MB/s, 0 for unlimited
+    double tail_percent; // percentage of writes that also pay tail_us
+    int tail_us;
+} disk_model_t;
+
 // These global configuration variables are defined and set in main
 extern int num_disks;
 extern int block_size;
 extern int disk_size;
+extern int raid_level;      // 4: dedicated parity disk, 5: rotating parity
 
 extern int debug;
+extern int disk_mmap;           // Map disk images instead of holding disks in memory
+extern int checkpoint_interval; // Seconds between periodic disk checkpoints
+
+// Tuning options, defined in controller.c and set in main
+extern int transport;         // TRANSPORT_PIPE or TRANSPORT_SHM
+extern int warm_start;        // Reuse the disk images from the last clean shutdown
+extern int queue_depth;       // Requests each disk can have outstanding at once
+extern int cache_blocks;      // Size of the block cache in blocks, 0 when disabled
+extern int writeback_stripes; // Size of the write-back buffer in stripes, 0 when disabled
+extern int rebuild_rate;      // Stripes rebuilt per second in the background, 0 for a blocking rebuild
+extern int spare_disks;       // Number of hot-spare disk processes
+extern int scrub_rate;        // Stripes checked per second by the scrub, 0 when disabled
+extern double hedge_percentile; // Read latency percentile after which reads are hedged, 0 when disabled
 
 // Controller Interface
 int init_all_controllers(int num_disks);
 int write_block(int block_num, char *data);
+int write_stripe(int stripe_num, char *data);
+int write_blocks(int block_num, int count, char *data);
 char *read_block(int block_num, char *data);
+int read_blocks(int block_num, int count, char *data);
+int access_blocks(block_access_t *batch, int n);
 int restart_disk(int disk_num);
 void simulate_disk_failure(int disk_num);
 void restore_disk_process(int disk_num);
 void checkpoint_and_wait();
+int checkpoint_disks();
+int flush_writeback();
+writeback_stats_t writeback_stats();
+int controller_idle();
+int controller_fd();
+array_status_t array_status();
+scrub_stats_t scrub_stats();
+hedge_stats_t hedge_stats();
+
+// Asynchronous disk requests
+int disk_submit(disk_io_t *io);
+int disk_complete(disk_io_t *io);
+int disk_poll(int timeout_ms);
+
+// Block cache
+int cache_init(int size);
+int cache_contains(int disk_num, int stripe_num);
+int cache_lookup(int disk_num, int stripe_num, char *data);
+void cache_store(int disk_num, int stripe_num, const char *data, int prefetched);
+void cache_invalidate(int disk_num, int stripe_num);
+cache_stats_t cache_stats();
+
+// Shell commands
+int execute_command(command_t *cmd);
+int replay_transactions(char *filename);
+
+// Statistics
+int stats_init(int total_disks);
+uint64_t stats_now();
+void stats_disk(int disk_num, disk_command_t cmd, uint64_t ns);
+void stats_op(stats_op_t op, long bytes, uint64_t ns);
+uint64_t stats_read_deadline(double percent);
+void stats_print(FILE *fp);
+int stats_dump(char *filename);
+
+// Tracing
+int trace_open(char *name_prefix);
+void trace_forked();
+int tracing();
+void trace_event(trace_op_t op, int disk_num, int stripe_num, uint64_t start);
+
+// Block checksums
+uint32_t crc32c(const void *data, size_t length);
 
 // Disk Interface
-int start_disk(int id, int to_parent, int from_parent);
+int start_disk(int id, int to_parent, int from_parent, char *shm, int load_image);
+int start_spare(int to_parent, int from_parent, char *shm);
+int disk_model_parse(char *spec);
 
 #endif // RAID_H
@@ -0,0 +1,554 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include "raid.h"
+
+/*
+ * This file implements a benchmark for the RAID system. It starts the
+ * disks as raid_sim does and drives the controller with a synthetic
+ * workload: a number of requests of a fixed number of blocks, at random
+ * or sequential positions, with a given share of reads, while killing
+ * disks at even intervals. It reports the throughput, the latency
+ * percentiles of the requests and how long each failed disk took to be
+ * rebuilt, as text or as JSON.
+ *
+ * Requests of a single block are issued queue_depth at a time through
+ * access_blocks, as far as they touch different stripes; the latency of
+ * each is that of its batch. Larger requests are issued one at a time
+ * through read_blocks and write_blocks.
+ *
+ * The benchmark starts from empty disks, so it keeps their images in a
+ * directory of its own, BENCH_DIR, where they cannot overwrite an array
+ * kept by raid_sim.
+ */
+
+// Defaults for the benchmark, which differ from raid_sim's so that the
+// array is large enough to measure
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_DISK_SIZE (16 * 1024 * 1024)
+#define BENCH_REQUESTS 100000
+#define BENCH_READ_PERCENT 50
+#define BENCH_DIR "bench"
+
+// Global variables for RAID configuration
+int num_disks = DEFAULT_NUM_DISKS;
+int block_size = BENCH_BLOCK_SIZE;
+int disk_size = BENCH_DISK_SIZE;
+int raid_level = DEFAULT_RAID_LEVEL;
+
+// One request of the workload
+typedef struct {
+    int block_num;
+    int write;
+} request_t;
+
+/* Print usage information for the program, which has name prog_name.
+ */
+static void print_usage(char *prog_name)
+{
+    fprintf(stderr, "Usage: %s [-n num_disks] [-b block_size] [-d disk_size] [-l level] [-i transport] [-m] [-q depth] [-C blocks] [-W stripes] [-R rate] [-s count] [-H percentile] [-D model] [-p pattern] [-r percent] [-x blocks] [-o requests] [-f failures] [-g seed] [-j]\n", prog_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -n num_disks   Number of data disks (default: %d)\n", DEFAULT_NUM_DISKS);
+    fprintf(stderr, "  -b block_size  Size of each block in bytes (default: %d)\n", BENCH_BLOCK_SIZE);
+    fprintf(stderr, "  -d disk_size   Size of each disk in bytes (default: %d)\n", BENCH_DISK_SIZE);
+    fprintf(stderr, "  -l level       RAID level: 4 (dedicated parity) or 5 (rotating parity) (default: %d)\n", DEFAULT_RAID_LEVEL);
+    fprintf(stderr, "  -i transport   Block transport to the disks: pipe or shm (default: pipe)\n");
+    fprintf(stderr, "  -m             Map each disk directly onto its %s/disk_N.dat image\n", BENCH_DIR);
+    fprintf(stderr, "  -q depth       Maximum requests outstanding on each disk, 1 to %d (default: %d)\n", MAX_QUEUE_DEPTH, DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "  -C blocks      Size of the controller block cache in blocks, 0 to disable (default: %d)\n", DEFAULT_CACHE_BLOCKS);
+    fprintf(stderr, "  -W stripes     Buffer writes to up to stripes stripes before writing them out, 0 to write through (default: %d)\n", DEFAULT_WRITEBACK_STRIPES);
+    fprintf(stderr, "  -R rate        Rebuild a restored disk in the background at rate stripes per second, 0 to rebuild it at once (default: %d)\n", DEFAULT_REBUILD_RATE);
+    fprintf(stderr, "  -s count       Keep count idle disk processes ready to replace a failed disk (default: %d)\n", DEFAULT_SPARE_DISKS);
+    fprintf(stderr, "  -H percentile  Hedge a read not answered within this percentile of disk read latency by reconstructing it, 0 to disable (default: %d)\n", DEFAULT_HEDGE_PERCENTILE);
+    fprintf(stderr, "  -D model       Disk service-time model: memory, hdd or ssd, then any of read=, write=, seek=,\n");
+    fprintf(stderr, "                 rotation=, tail_latency= (us), bandwidth= (MB/s), tail= (%% of writes), comma-separated;\n");
+    fprintf(stderr, "                 N:model applies to disk N only, and -D may be repeated (default: memory)\n");
+    fprintf(stderr, "  -p pattern     Where requests go: random or sequential (default: random)\n");
+    fprintf(stderr, "  -r percent     Percentage of requests that are reads (default: %d)\n", BENCH_READ_PERCENT);
+    fprintf(stderr, "  -x blocks      Blocks in each request (default: 1)\n");
+    fprintf(stderr, "  -o requests    Number of requests (default: %d)\n", BENCH_REQUESTS);
+    fprintf(stderr, "  -f failures    Number of disks killed during the run, one at a time (default: 0)\n");
+    fprintf(stderr, "  -g seed        Seed for the random workload (default: 1)\n");
+    fprintf(stderr, "  -j             Print the results as JSON\n");
+    exit(1);
+}
+
+/* Return the number of seconds from start to end.
+ */
+static double seconds_between(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Compare two latencies for qsort.
+ */
+static int compare_latency(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Return the latency below which fraction of the count sorted latencies
+ * fall.
+ */
+static double percentile(double *sorted, int count, double fraction)
+{
+    int i = (int)(fraction * count + 0.999999) - 1;
+    if (i < 0)
+    {
+        i = 0;
+    }
+    if (i >= count)
+    {
+        i = count - 1;
+    }
+    return sorted[i];
+}
+
+/* Return 1 if no disk is degraded or being rebuilt.
+ */
+static int array_healthy()
+{
+    array_status_t status = array_status();
+    return status.degraded_disk < 0 && status.rebuilding_disk < 0;
+}
+
+/* Return the number of requests, starting at first and at most
+ * queue_depth, that can be issued together: all of them if they are of
+ * more than one block, and otherwise until one would write a stripe an
+ * earlier one touches, or read a stripe an earlier one writes.
+ */
+static int batch_size(request_t *requests, int first, int count, int request_blocks)
+{
+    if (request_blocks > 1)
+    {
+        return 1;
+    }
+
+    int n = 1;
+    while (n < queue_depth && first + n < count)
+    {
+        request_t *r = &requests[first + n];
+        for (int i = first; i < first + n; i++)
+        {
+            if (requests[i].block_num / num_disks == r->block_num / num_disks &&
+                (r->write || requests[i].write))
+            {
+                return n;
+            }
+        }
+        n++;
+    }
+    return n;
+}
+
+/* The main entry point for the RAID benchmark.
+ */
+int main(int argc, char **argv)
+{
+    int sequential = 0;
+    int read_percent = BENCH_READ_PERCENT;
+    int request_blocks = 1;
+    int count = BENCH_REQUESTS;
+    int failures = 0;
+    unsigned int seed = 1;
+    int json = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:d:l:i:mq:C:W:R:s:H:D:p:r:x:o:f:g:jh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            num_disks = atoi(optarg);
+            if (num_disks <= 0)
+            {
+                fprintf(stderr, "Error: Number of disks must be positive\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'b':
+            block_size = atoi(optarg);
+            if (block_size <= 0)
+            {
+                fprintf(stderr, "Error: Block size must be positive\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'd':
+            disk_size = atoi(optarg);
+            if (disk_size <= 0)
+            {
+                fprintf(stderr, "Error: Disk size must be positive\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'l':
+            raid_level = atoi(optarg);
+            if (raid_level != 4 && raid_level != 5)
+            {
+                fprintf(stderr, "Error: RAID level must be 4 or 5\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "pipe") == 0)
+            {
+                transport = TRANSPORT_PIPE;
+            }
+            else if (strcmp(optarg, "shm") == 0)
+            {
+                transport = TRANSPORT_SHM;
+            }
+            else
+            {
+                fprintf(stderr, "Error: Transport must be pipe or shm\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'm':
+            disk_mmap = 1;
+            break;
+        case 'q':
+            queue_depth = atoi(optarg);
+            if (queue_depth < 1 || queue_depth > MAX_QUEUE_DEPTH)
+            {
+                fprintf(stderr, "Error: Queue depth must be between 1 and %d\n", MAX_QUEUE_DEPTH);
+                print_usage(argv[0]);
+            }
+            break;
+        case 'C':
+            cache_blocks = atoi(optarg);
+            if (cache_blocks < 0)
+            {
+                fprintf(stderr, "Error: Cache size must not be negative\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'W':
+            writeback_stripes = atoi(optarg);
+            if (writeback_stripes < 0)
+            {
+                fprintf(stderr, "Error: Write-back buffer size must not be negative\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'R':
+            rebuild_rate = atoi(optarg);
+            if (rebuild_rate < 0)
+            {
+                fprintf(stderr, "Error: Rebuild rate must not be negative\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 's':
+            spare_disks = atoi(optarg);
+            if (spare_disks < 0)
+            {
+                fprintf(stderr, "Error: Number of hot spares must not be negative\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'H':
+            hedge_percentile = atof(optarg);
+            if (hedge_percentile < 0 || hedge_percentile >= 100)
+            {
+                fprintf(stderr, "Error: Hedging percentile must be at least 0 and below 100\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'D':
+            if (disk_model_parse(optarg) != 0)
+            {
+                print_usage(argv[0]);
+            }
+            break;
+        case 'p':
+            if (strcmp(optarg, "random") == 0)
+            {
+                sequential = 0;
+            }
+            else if (strcmp(optarg, "sequential") == 0)
+            {
+                sequential = 1;
+            }
+            else
+            {
+                fprintf(stderr, "Error: Pattern must be random or sequential\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'r':
+            read_percent = atoi(optarg);
+            if (read_percent < 0 || read_percent > 100)
+            {
+                fprintf(stderr, "Error: Read percentage must be between 0 and 100\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'x':
+            request_blocks = atoi(optarg);
+            if (request_blocks <= 0)
+            {
+                fprintf(stderr, "Error: Request size must be positive\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'o':
+            count = atoi(optarg);
+            if (count <= 0)
+            {
+                fprintf(stderr, "Error: Number of requests must be positive\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'f':
+            failures = atoi(optarg);
+            if (failures < 0)
+            {
+                fprintf(stderr, "Error: Number of failures must not be negative\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'g':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'h':
+        default:
+            print_usage(argv[0]);
+        }
+    }
+
+    int total_blocks = (disk_size / block_size) * num_disks;
+    if (request_blocks > total_blocks)
+    {
+        fprintf(stderr, "Error: Requests of %d blocks do not fit in the %d blocks of the array\n",
+                request_blocks, total_blocks);
+        print_usage(argv[0]);
+    }
+
+    // the disks' messages would be mixed into the results
+    debug = 0;
+
+    // the workload is decided in advance, so that it does not depend on
+    // how fast the requests complete
+    request_t *requests = malloc(count * sizeof(*requests));
+    double *latencies = malloc(count * sizeof(*latencies));
+    double *rebuilds = malloc((failures + 1) * sizeof(*rebuilds));
+    block_access_t *batch = malloc(queue_depth * sizeof(*batch));
+    char *data = malloc((size_t)queue_depth * request_blocks * block_size);
+    if (!requests || !latencies || !rebuilds || !batch || !data)
+    {
+        perror("Failed to allocate the workload");
+        return 1;
+    }
+
+    srand(seed);
+    for (size_t i = 0; i < (size_t)queue_depth * request_blocks * block_size; i++)
+    {
+        data[i] = rand();
+    }
+    int next_block = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (sequential)
+        {
+            if (next_block + request_blocks > total_blocks)
+            {
+                next_block = 0;
+            }
+            requests[i].block_num = next_block;
+            next_block += request_blocks;
+        }
+        else
+        {
+            requests[i].block_num = rand() % (total_blocks - request_blocks + 1);
+        }
+        requests[i].write = rand() % 100 >= read_percent;
+    }
+
+    // the images are created afresh, so not where raid_sim keeps its own
+    if ((mkdir(BENCH_DIR, 0755) != 0 && errno != EEXIST) || chdir(BENCH_DIR) != 0)
+    {
+        perror(BENCH_DIR);
+        return 1;
+    }
+
+    if (init_all_controllers(num_disks + 1) == -1)
+    {
+        fprintf(stderr, "Failed to initialize disk processes\n");
+        return 1;
+    }
+
+    int errors = 0;
+    int killed = 0;
+    int rebuilt = 0;
+    struct timespec start, end, failed_at;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int i = 0;
+    while (i < count)
+    {
+        // the next disk is killed once its share of the requests is done
+        // and the array has recovered from the last one
+        if (killed < failures && i >= (long)count * (killed + 1) / (failures + 1) && array_healthy())
+        {
+            simulate_disk_failure(killed % (num_disks + 1));
+            clock_gettime(CLOCK_MONOTONIC, &failed_at);
+            killed++;
+        }
+
+        int n = batch_size(requests, i, count, request_blocks);
+        struct timespec issued, completed;
+        clock_gettime(CLOCK_MONOTONIC, &issued);
+        if (request_blocks == 1)
+        {
+            for (int k = 0; k < n; k++)
+            {
+                batch[k] = (block_access_t){requests[i + k].block_num, requests[i + k].write,
+                                            &data[(size_t)k * block_size], 0};
+            }
+            access_blocks(batch, n);
+            for (int k = 0; k < n; k++)
+            {
+                errors += batch[k].status != 0;
+            }
+        }
+        else if (requests[i].write)
+        {
+            errors += write_blocks(requests[i].block_num, request_blocks, data) != 0;
+        }
+        else
+        {
+            errors += read_blocks(requests[i].block_num, request_blocks, data) != 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &completed);
+
+        for (int k = 0; k < n; k++)
+        {
+            latencies[i + k] = seconds_between(&issued, &completed) * 1e6;
+        }
+        i += n;
+
+        // the controller does its background work between requests, as it
+        // does between the shell's commands
+        controller_idle();
+        if (rebuilt < killed && array_healthy())
+        {
+            rebuilds[rebuilt++] = seconds_between(&failed_at, &completed) * 1e3;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // a rebuild still going on is waited for, but not counted in the run
+    while (rebuilt < killed)
+    {
+        int wait = controller_idle();
+        if (array_healthy())
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            rebuilds[rebuilt++] = seconds_between(&failed_at, &now) * 1e3;
+        }
+        else if (wait > 0)
+        {
+            poll(NULL, 0, wait);
+        }
+    }
+    checkpoint_and_wait();
+
+    double elapsed = seconds_between(&start, &end);
+    double iops = count / elapsed;
+    double mbps = (double)count * request_blocks * block_size / elapsed / 1e6;
+    double mean = 0;
+    for (int k = 0; k < count; k++)
+    {
+        mean += latencies[k] / count;
+    }
+    qsort(latencies, count, sizeof(*latencies), compare_latency);
+    double p50 = percentile(latencies, count, 0.50);
+    double p99 = percentile(latencies, count, 0.99);
+    double p999 = percentile(latencies, count, 0.999);
+    double rebuild_max = 0;
+    double rebuild_mean = 0;
+    for (int k = 0; k < rebuilt; k++)
+    {
+        rebuild_mean += rebuilds[k] / rebuilt;
+        if (rebuilds[k] > rebuild_max)
+        {
+            rebuild_max = rebuilds[k];
+        }
+    }
+
+    hedge_stats_t hedges = hedge_stats();
+    if (json)
+    {
+        printf("{\"config\": {\"level\": %d, \"data_disks\": %d, \"block_size\": %d, \"disk_size\": %d, "
+               "\"transport\": \"%s\", \"queue_depth\": %d, \"cache_blocks\": %d, \"writeback_stripes\": %d, "
+               "\"rebuild_rate\": %d, \"spare_disks\": %d, \"hedge_percentile\": %g}, ",
+               raid_level, num_disks, block_size, disk_size, transport == TRANSPORT_SHM ? "shm" : "pipe",
+               queue_depth, cache_blocks, writeback_stripes, rebuild_rate, spare_disks, hedge_percentile);
+        printf("\"workload\": {\"pattern\": \"%s\", \"read_percent\": %d, \"request_blocks\": %d, "
+               "\"requests\": %d, \"failures\": %d, \"seed\": %u}, ",
+               sequential ? "sequential" : "random", read_percent, request_blocks, count, failures, seed);
+        printf("\"results\": {\"seconds\": %.6f, \"iops\": %.1f, \"mb_per_s\": %.3f, \"errors\": %d, "
+               "\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}, "
+               "\"hedged_reads\": %lu, \"hedges_won\": %lu, \"hedges_diverted\": %lu, \"rebuild_ms\": [",
+               elapsed, iops, mbps, errors, mean, p50, p99, p999, latencies[count - 1], hedges.hedged,
+               hedges.won, hedges.diverted);
+        for (int k = 0; k < rebuilt; k++)
+        {
+            printf("%s%.3f", k ? ", " : "", rebuilds[k]);
+        }
+        printf("]}}\n");
+    }
+    else
+    {
+        printf("Array: RAID %d, %d data disks, %d-byte blocks, %d-byte disks, %s transport, queue depth %d\n",
+               raid_level, num_disks, block_size, disk_size, transport == TRANSPORT_SHM ? "shm" : "pipe",
+               queue_depth);
+        printf("Workload: %d %s %d-block requests, %d%% reads, %d disk failures\n",
+               count, sequential ? "sequential" : "random", request_blocks, read_percent, failures);
+        printf("Throughput: %.0f IOPS, %.1f MB/s over %.3f s, %d errors\n", iops, mbps, elapsed, errors);
+        printf("Latency: mean %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+               mean, p50, p99, p999, latencies[count - 1]);
+        if (hedge_percentile > 0)
+        {
+            printf("Hedged reads: %lu past the p%g deadline, %lu answered first by reconstruction, %lu sent straight to reconstruction\n",
+                   hedges.hedged, hedge_percentile, hedges.won, hedges.diverted);
+        }
+        if (rebuilt > 0)
+        {
+            printf("Rebuild: %d disks rebuilt, mean %.1f ms, max %.1f ms\n", rebuilt, rebuild_mean, rebuild_max);
+        }
+    }
+
+    free(requests);
+    free(latencies);
+    free(rebuilds);
+    free(batch);
+    free(data);
+    return 0;
+}
@@ -13,8 +13,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "raid.h"
 
 /*
@@ -29,21 +34,46 @@
 // Maximum length of a buffer to hold a RAID command
 #define MAX_CMD_LENGTH 256
 
+// Bytes read from the RAID system at a time by the rr command
+#define READ_CHUNK (1 << 20)
+
 // Global variables for RAID configuration
 int num_disks = DEFAULT_NUM_DISKS;
 int block_size = DEFAULT_BLOCK_SIZE;
 int disk_size = DEFAULT_DISK_SIZE;
+int raid_level = DEFAULT_RAID_LEVEL;
+
+// File the statistics are written to at exit, or NULL
+static char *stats_file = NULL;
 
 /* Print usage information for the program, which has name prog_name.
  */
 static void print_usage(char *prog_name)
 {
-    fprintf(stderr, "Usage: %s [-n num_disks] [-b block_size] [-d disk_size] [-t file_name]\n", prog_name);
+    fprintf(stderr, "Usage: %s [-n num_disks] [-b block_size] [-d disk_size] [-l level] [-i transport] [-m] [-c seconds] [-w] [-q depth] [-C blocks] [-W stripes] [-R rate] [-s count] [-S rate] [-H percentile] [-D model] [-t file_name] [-r file_name] [-o file_name] [-T prefix]\n", prog_name);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -n num_disks   Number of data disks (default: %d)\n", DEFAULT_NUM_DISKS);
     fprintf(stderr, "  -b block_size  Size of each block in bytes (default: %d)\n", DEFAULT_BLOCK_SIZE);
     fprintf(stderr, "  -d disk_size   Size of each disk in bytes (default: %d)\n", DEFAULT_DISK_SIZE);
+    fprintf(stderr, "  -l level       RAID level: 4 (dedicated parity) or 5 (rotating parity) (default: %d)\n", DEFAULT_RAID_LEVEL);
+    fprintf(stderr, "  -i transport   Block transport to the disks: pipe or shm (default: pipe)\n");
+    fprintf(stderr, "  -m             Map each disk directly onto its disk_N.dat image\n");
+    fprintf(stderr, "  -c seconds     Checkpoint each disk's dirty blocks every seconds seconds (default: only at exit)\n");
+    fprintf(stderr, "  -w             Warm start from the disk images of the last clean shutdown\n");
+    fprintf(stderr, "  -q depth       Maximum requests outstanding on each disk, 1 to %d (default: %d)\n", MAX_QUEUE_DEPTH, DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "  -C blocks      Size of the controller block cache in blocks, 0 to disable (default: %d)\n", DEFAULT_CACHE_BLOCKS);
+    fprintf(stderr, "  -W stripes     Buffer writes to up to stripes stripes before writing them out, 0 to write through (default: %d)\n", DEFAULT_WRITEBACK_STRIPES);
+    fprintf(stderr, "  -R rate        Rebuild a restored disk in the background at rate stripes per second, 0 to rebuild it at once (default: %d)\n", DEFAULT_REBUILD_RATE);
+    fprintf(stderr, "  -s count       Keep count idle disk processes ready to replace a failed disk (default: %d)\n", DEFAULT_SPARE_DISKS);
+    fprintf(stderr, "  -S rate        Scrub the array in the background at rate stripes per second, 0 to disable (default: %d)\n", DEFAULT_SCRUB_RATE);
+    fprintf(stderr, "  -H percentile  Hedge a read not answered within this percentile of disk read latency by reconstructing it, 0 to disable (default: %d)\n", DEFAULT_HEDGE_PERCENTILE);
+    fprintf(stderr, "  -D model       Disk service-time model: memory, hdd or ssd, then any of read=, write=, seek=,\n");
+    fprintf(stderr, "                 rotation=, tail_latency= (us), bandwidth= (MB/s), tail= (%% of writes), comma-separated;\n");
+    fprintf(stderr, "                 N:model applies to disk N only, and -D may be repeated (default: memory)\n");
     fprintf(stderr, "  -t file_name   Use the transaction file named file_name instead of stdin for input\n");
+    fprintf(stderr, "  -r file_name   Replay the transaction file named file_name, overlapping commands on different stripes\n");
+    fprintf(stderr, "  -o file_name   Write the disk and operation statistics to file_name at exit\n");
+    fprintf(stderr, "  -T prefix      Trace the controller and every disk to files named prefix.<pid>, read by trace_decode\n");
     exit(1);
 }
 
@@ -51,16 +81,32 @@ static void print_usage(char *prog_name)
  */
 static void print_command_shell_header()
 {
-    printf("RAID 4 Simulator Shell\n");
+    printf("RAID %d Simulator Shell\n", raid_level);
     printf("System configuration:\n");
     printf("  Number of data disks: %d\n", num_disks);
+    printf("  Parity layout: %s\n", raid_level == 5 ? "rotating" : "dedicated disk");
     printf("  Block size: %d bytes\n", block_size);
     printf("  Disk size: %d bytes\n", disk_size);
+    printf("  Transport: %s\n", transport == TRANSPORT_SHM ? "shared memory" : "pipe");
+    printf("  Block cache: %d blocks\n", cache_blocks);
+    printf("  Write-back buffer: %d stripes\n", writeback_stripes);
+    printf("  Rebuild rate: %d stripes/s\n", rebuild_rate);
+    printf("  Hot spares: %d\n", spare_disks);
+    printf("  Scrub rate: %d stripes/s\n", scrub_rate);
+    printf("  Hedged reads: %s\n", hedge_percentile > 0 ? "on" : "off");
 
     printf("Available commands:\n");
     printf("  wb <block_num> <file from local> \n");
+    printf("  ws <stripe_num> <file from local> \n");
+    printf("  wf <start_block> <file from local> \n");
     printf("  rb <block_num> \n");
+    printf("  rr <start_block> <count> [file to local] \n");
     printf("  kill <disk_num> \n");
+    printf("  checkpoint \n");
+    printf("  cache \n");
+    printf("  flush \n");
+    printf("  status \n");
+    printf("  stats \n");
     printf("  exit \n");
 }
 
@@ -96,6 +142,144 @@ static int print_block(int block_num)
     return 0;
 }
 
+/* Print count blocks of the RAID system, starting at block_num, to the
+ * file named filename, or to stdout if filename is NULL. The blocks are
+ * read READ_CHUNK bytes at a time, in whole stripes, so that each call
+ * to read_blocks has work for every disk.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+static int print_blocks(int block_num, int count, char *filename)
+{
+    size_t stripe_size = (size_t)num_disks * block_size;
+    int chunk = (READ_CHUNK > stripe_size ? READ_CHUNK / stripe_size : 1) * num_disks;
+    char *buffer = malloc((size_t)chunk * block_size);
+    if (!buffer)
+    {
+        perror("Failed to allocate memory for blocks");
+        return -1;
+    }
+
+    FILE *fp = filename ? fopen(filename, "wb") : stdout;
+    if (!fp)
+    {
+        char msg[MAX_NAME];
+        snprintf(msg, sizeof(msg), "Error opening %s", filename);
+        perror(msg);
+        free(buffer);
+        return -1;
+    }
+
+    int status = 0;
+    for (int i = 0; i < count && status == 0; i += chunk)
+    {
+        int n = count - i < chunk ? count - i : chunk;
+        if (read_blocks(block_num + i, n, buffer) != 0)
+        {
+            fprintf(stderr, "Failed to read blocks from RAID\n");
+            status = -1;
+        }
+        else if (fwrite(buffer, block_size, n, fp) != (size_t)n)
+        {
+            fprintf(stderr, "Failed to write blocks\n");
+            status = -1;
+        }
+    }
+
+    if (filename && fclose(fp) != 0)
+    {
+        perror("Failed to close output file");
+        status = -1;
+    }
+    free(buffer);
+
+    if (status == 0)
+    {
+        fprintf(stderr, "Blocks %d-%d printed\n", block_num, block_num + count - 1);
+    }
+    return status;
+}
+
+// Input read from the command descriptor but not yet executed. Commands
+// are read into it rather than through stdio, so that poll sees whether
+// one is waiting whether the input is a terminal, a pipe or a file.
+static char input[MAX_CMD_LENGTH - 1];
+static size_t input_len;
+
+/* Return whether input holds a whole command, or as much of one as a
+ * command line can hold.
+ */
+static int command_ready()
+{
+    return memchr(input, '\n', input_len) != NULL || input_len == sizeof(input);
+}
+
+/* Read the next command line from the descriptor fd into line, which has
+ * space for MAX_CMD_LENGTH bytes, keeping its newline as fgets does. The
+ * last line of the input need not end in a newline.
+ *
+ * Returns 1 if a line was read, 0 at the end of the input and -1 on
+ * failure.
+ */
+static int read_command(int fd, char *line)
+{
+    while (!command_ready())
+    {
+        ssize_t n = read(fd, &input[input_len], sizeof(input) - input_len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            if (input_len == 0)
+            {
+                return 0;
+            }
+            break;
+        }
+        input_len += n;
+    }
+
+    char *newline = memchr(input, '\n', input_len);
+    size_t length = newline ? (size_t)(newline - input) + 1 : input_len;
+    memcpy(line, input, length);
+    line[length] = '\0';
+    input_len -= length;
+    memmove(input, &input[length], input_len);
+    return 1;
+}
+
+/* Let the controller do its background work until the next command can
+ * be read from fd. A disk that fails in the meantime wakes the controller
+ * up, so that it is recovered without waiting for the next command.
+ */
+static void wait_for_command(int fd)
+{
+    fflush(stdout);
+    if (command_ready())
+    {
+        controller_idle();
+        return;
+    }
+
+    struct pollfd fds[2] = {
+        {fd, POLLIN, 0},
+        {controller_fd(), POLLIN, 0},
+    };
+    do
+    {
+        fds[0].revents = 0;
+        poll(fds, 2, controller_idle());
+        // until the command arrives, go round again whenever the
+        // controller's timeout expires or a disk fails
+    } while (fds[0].revents == 0);
+}
+
 /* Parse a command line into a command structure.
  *
  * Returns a pointer to the parsed command structure, or NULL on error.
@@ -104,7 +288,7 @@ static int print_block(int block_num)
  * This function modifies the input line by replacing spaces with nulls.
  */
 
-// each command line (either through input or transaction file) has 3 tokens
+// each command line (either through input or transaction file) has up to 4 tokens
 command_t *parse_command(char *line)
 {
     // creates a command struct
@@ -114,9 +298,10 @@ command_t *parse_command(char *line)
         perror("Failed to allocate command structure");
         return NULL;
     }
-    // sets the arg1 and arg2 fields in the struct to null
+    // sets the arg fields in the struct to null
     cmd->arg1 = NULL;
     cmd->arg2 = NULL;
+    cmd->arg3 = NULL;
 
     // assign the first element
     cmd->cmd = strtok(line, " ");
@@ -127,6 +312,7 @@ command_t *parse_command(char *line)
     }
     cmd->arg1 = strtok(NULL, " ");
     cmd->arg2 = strtok(NULL, " ");
+    cmd->arg3 = strtok(NULL, " ");
 
     return cmd;
 }
@@ -189,13 +375,170 @@ static int copy_block_to_raid(int block_num, char *filename)
     return 0;
 }
 
+/* Copy a full stripe from a local file named filename to the RAID system
+ * at stripe stripe_num. The first num_disks * block_size bytes of the file
+ * become the data blocks of the stripe.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+static int copy_stripe_to_raid(int stripe_num, char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        char msg[MAX_NAME];
+        snprintf(msg, sizeof(msg), "Error opening %s", filename);
+        perror(msg);
+        return -1;
+    }
+
+    size_t stripe_size = (size_t)num_disks * block_size;
+    char *buffer = malloc(stripe_size);
+    if (!buffer)
+    {
+        perror("Failed to allocate memory for stripe");
+        fclose(fp);
+        return -1;
+    }
+
+    size_t bytes_read = fread(buffer, 1, stripe_size, fp);
+    if (bytes_read < stripe_size)
+    {
+        if (ferror(fp))
+        {
+            fprintf(stderr, "Error reading file");
+        }
+        else if (feof(fp))
+        {
+            fprintf(stderr, "Error: File is smaller than stripe size\n");
+        }
+        free(buffer);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    if (write_stripe(stripe_num, buffer) != 0)
+    {
+        fprintf(stderr, "Failed to write stripe to RAID");
+        free(buffer);
+        return -1;
+    }
+
+    free(buffer);
+    fprintf(stderr, "Stripe %d written to RAID\n", stripe_num);
+    return 0;
+}
+
+/* Copy the whole of the local file named filename to the RAID system,
+ * starting at block block_num. The file is mapped rather than read, and
+ * the stripes it covers completely are written whole, straight from the
+ * mapping, without reading back old data or parity. The blocks from the
+ * last stripe boundary to the end of the file are copied into a buffer,
+ * with the file's last block padded with zeros.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+static int copy_file_to_raid(int block_num, char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        char msg[MAX_NAME];
+        snprintf(msg, sizeof(msg), "Error opening %s", filename);
+        perror(msg);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    int count = (size + block_size - 1) / block_size;
+    if (count == 0 || block_num < 0 || block_num + count > (disk_size / block_size) * num_disks)
+    {
+        fprintf(stderr, "Error: File does not fit in the RAID system at block %d\n", block_num);
+        close(fd);
+        return -1;
+    }
+
+    char *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED)
+    {
+        perror("Failed to map file");
+        return -1;
+    }
+    madvise(file, size, MADV_SEQUENTIAL);
+
+    // The whole blocks up to the last stripe boundary come straight from
+    // the file; the rest, at most a stripe, needs padding
+    int direct = count;
+    if (size % block_size != 0)
+    {
+        direct = (block_num + count - 1) / num_disks * num_disks - block_num;
+        if (direct < 0)
+        {
+            direct = 0;
+        }
+    }
+
+    int status = write_blocks(block_num, direct, file);
+    if (status == 0 && direct < count)
+    {
+        size_t rest = size - (size_t)direct * block_size;
+        char *buffer = calloc(count - direct, block_size);
+        if (!buffer)
+        {
+            perror("Failed to allocate memory for blocks");
+            munmap(file, size);
+            return -1;
+        }
+        memcpy(buffer, &file[(size_t)direct * block_size], rest);
+        status = write_blocks(block_num + direct, count - direct, buffer);
+        free(buffer);
+    }
+    munmap(file, size);
+
+    if (status != 0)
+    {
+        fprintf(stderr, "Failed to write file to RAID\n");
+        return -1;
+    }
+    fprintf(stderr, "File written to RAID at blocks %d-%d\n", block_num, block_num + count - 1);
+    return 0;
+}
+
+/* Shut the RAID system down: checkpoint the disks and wait for them to
+ * exit, then write out the statistics if the o option asked for them.
+ */
+static void shut_down()
+{
+    checkpoint_and_wait();
+    if (stats_file)
+    {
+        stats_dump(stats_file);
+    }
+}
+
 /* Execute a parsed command cmd.
  *
  * This function implements the RAID shell commands:
  * - exit: Exit the program
  * - wb: Write a block from a local file to the RAID system
+ * - ws: Write a full stripe from a local file to the RAID system
+ * - wf: Write a whole local file to the RAID system
  * - rb: Read a block from the RAID system to stdout
+ * - rr: Read a range of blocks from the RAID system to stdout or a file
  * - kill: Kills one of the disk processes
+ * - checkpoint: Saves the blocks changed on each disk to its image file
+ * - flush: Writes the stripes in the write-back buffer to the disks
+ * - cache: Prints the block cache's counters
+ * - status: Prints whether a disk is down or being rebuilt
+ * - stats: Prints the counts and latencies of each disk's requests and
+ *   of the controller's operations
  *
  * Returns 0 on success and -1 on error.
  */
@@ -210,7 +553,7 @@ int execute_command(command_t *cmd)
     // if the command is exit, exit the program
     if (strcmp(cmd->cmd, "exit") == 0)
     {
-        checkpoint_and_wait();
+        shut_down();
         exit(0);
     }
 
@@ -229,6 +572,33 @@ int execute_command(command_t *cmd)
         return 0;
     }
 
+    // if the command is ws <stripe_num> <filename>, write the first
+    // num_disks * block_size bytes of filename as stripe stripe_num,
+    // without reading back the old data or parity
+    else if (strcmp(cmd->cmd, "ws") == 0)
+    {
+        if (cmd->arg2 == NULL || cmd->arg1 == NULL)
+        {
+            printf("Usage: ws <stripe_num> <file from local>\n");
+            return -1;
+        }
+        copy_stripe_to_raid(atoi(cmd->arg1), cmd->arg2);
+        return 0;
+    }
+
+    // if the command is wf <start_block> <filename>, write all of filename
+    // to consecutive blocks from start_block on
+    else if (strcmp(cmd->cmd, "wf") == 0)
+    {
+        if (cmd->arg2 == NULL || cmd->arg1 == NULL)
+        {
+            printf("Usage: wf <start_block> <file from local>\n");
+            return -1;
+        }
+        copy_file_to_raid(atoi(cmd->arg1), cmd->arg2);
+        return 0;
+    }
+
     // if the command is rb <block_num>, we read the block number block_num
     // from the RAID system and print it to stdout. Use ASCII chars to make testing easier.
     else if (strcmp(cmd->cmd, "rb") == 0)
@@ -242,18 +612,114 @@ int execute_command(command_t *cmd)
         return 0;
     }
 
+    // if the command is rr <start_block> <count> [filename], we read count
+    // consecutive blocks and print them to stdout, or write them to filename
+    else if (strcmp(cmd->cmd, "rr") == 0)
+    {
+        if (cmd->arg1 == NULL || cmd->arg2 == NULL || atoi(cmd->arg2) <= 0)
+        {
+            printf("Usage: rr <start_block> <count> [file to local]\n");
+            return -1;
+        }
+        print_blocks(atoi(cmd->arg1), atoi(cmd->arg2), cmd->arg3);
+        return 0;
+    }
+
     // if the command is kill <disk_num> we simulate disk failure by sending SIGNIT signal
     // to the disk process with id disk_num
     else if (strcmp(cmd->cmd, "kill") == 0)
     {
-        if (cmd->arg1 == NULL)
+        // the hot spares follow the data and parity disks, and are not
+        // disks of the array
+        if (cmd->arg1 == NULL || atoi(cmd->arg1) < 0 || atoi(cmd->arg1) > num_disks)
         {
-            printf("Usage: kill <disk_num>\n");
+            printf("Usage: kill <disk_num>, where disk_num is 0 to %d\n", num_disks);
             return -1;
         }
         simulate_disk_failure(atoi(cmd->arg1));
         return 0;
     }
+    // if the command is checkpoint, every disk writes its dirty blocks
+    // to its image file
+    else if (strcmp(cmd->cmd, "checkpoint") == 0)
+    {
+        if (checkpoint_disks() != 0)
+        {
+            fprintf(stderr, "Checkpoint incomplete\n");
+            return -1;
+        }
+        fprintf(stderr, "Checkpoint complete\n");
+        return 0;
+    }
+    // if the command is flush, write every buffered stripe to the disks
+    else if (strcmp(cmd->cmd, "flush") == 0)
+    {
+        if (flush_writeback() != 0)
+        {
+            fprintf(stderr, "Flush incomplete\n");
+            return -1;
+        }
+        writeback_stats_t stats = writeback_stats();
+        fprintf(stderr, "Flush complete: %lu block writes buffered, %lu stripes written (%lu full)\n",
+                stats.blocks, stats.stripes, stats.full_stripes);
+        return 0;
+    }
+    // if the command is status, print which disk is down or being rebuilt,
+    // how many hot spares are ready and what the scrub has found
+    else if (strcmp(cmd->cmd, "status") == 0)
+    {
+        array_status_t status = array_status();
+        if (status.degraded_disk >= 0)
+        {
+            fprintf(stderr, "Disk %d: failed, its blocks are reconstructed from the other disks\n",
+                    status.degraded_disk);
+        }
+        else if (status.rebuilding_disk >= 0)
+        {
+            fprintf(stderr, "Disk %d: rebuilding, %d of %d stripes done (%.1f%%)\n",
+                    status.rebuilding_disk, status.watermark, status.stripes,
+                    100.0 * status.watermark / status.stripes);
+        }
+        else
+        {
+            fprintf(stderr, "All disks online\n");
+        }
+        if (spare_disks > 0)
+        {
+            fprintf(stderr, "Hot spares: %d of %d ready\n", status.spares, spare_disks);
+        }
+        scrub_stats_t scrub = scrub_stats();
+        if (scrub_rate > 0 || scrub.bad_checksums > 0)
+        {
+            fprintf(stderr, "Scrub: %lu stripes checked, %lu of %lu corrupt blocks repaired, %lu parity blocks rewritten\n",
+                    scrub.stripes, scrub.repaired, scrub.bad_checksums, scrub.parity_repairs);
+        }
+        return 0;
+    }
+    // if the command is stats, print the counts and latency percentiles
+    // of every disk's requests and of the controller's operations
+    else if (strcmp(cmd->cmd, "stats") == 0)
+    {
+        stats_print(stderr);
+        if (hedge_percentile > 0)
+        {
+            hedge_stats_t hedges = hedge_stats();
+            fprintf(stderr, "Hedged reads: %lu past the p%g deadline, %lu answered first by reconstruction, %lu sent straight to reconstruction\n",
+                    hedges.hedged, hedge_percentile, hedges.won, hedges.diverted);
+        }
+        return 0;
+    }
+    // if the command is cache, print the block cache's counters
+    else if (strcmp(cmd->cmd, "cache") == 0)
+    {
+        cache_stats_t stats = cache_stats();
+        unsigned long lookups = stats.hits + stats.misses;
+        fprintf(stderr, "Cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+                stats.hits, stats.misses, lookups ? 100.0 * stats.hits / lookups : 0.0);
+        fprintf(stderr, "Cache: %lu blocks read ahead, %lu of them used, %lu evictions\n",
+                stats.prefetched, stats.prefetch_hits, stats.evictions);
+        return 0;
+    }
     // if the command isnt recognized (typo, for example)
     else
     {
@@ -278,10 +744,12 @@ int main(int argc, char **argv)
 {
     // by default commands are read from stdin unless the -t option is provided
     FILE *tf = stdin;
+    // with the r option, commands are replayed from this file instead
+    char *replay_file = NULL;
 
     // Parse command line arguments
     int opt;
-    while ((opt = getopt(argc, argv, "n:b:d:t:h")) != -1)
+    while ((opt = getopt(argc, argv, "n:b:d:l:i:mc:wq:C:W:R:s:S:H:D:t:r:o:T:h")) != -1)
     {
         switch (opt)
         {
@@ -309,6 +777,105 @@ int main(int argc, char **argv)
                 print_usage(argv[0]);
             }
             break;
+        case 'l':
+            raid_level = atoi(optarg);
+            if (raid_level != 4 && raid_level != 5)
+            {
+                fprintf(stderr, "Error: RAID level must be 4 or 5\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "pipe") == 0)
+            {
+                transport = TRANSPORT_PIPE;
+            }
+            else if (strcmp(optarg, "shm") == 0)
+            {
+                transport = TRANSPORT_SHM;
+            }
+            else
+            {
+                fprintf(stderr, "Error: Transport must be pipe or shm\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'm':
+            disk_mmap = 1;
+            break;
+        case 'c':
+            checkpoint_interval = atoi(optarg);
+            if (checkpoint_interval < 0)
+            {
+                fprintf(stderr, "Error: Checkpoint interval must not be negative\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'w':
+            warm_start = 1;
+            break;
+        case 'q':
+            queue_depth = atoi(optarg);
+            if (queue_depth < 1 || queue_depth > MAX_QUEUE_DEPTH)
+            {
+                fprintf(stderr, "Error: Queue depth must be between 1 and %d\n", MAX_QUEUE_DEPTH);
+                print_usage(argv[0]);
+            }
+            break;
+        case 'C':
+            cache_blocks = atoi(optarg);
+            if (cache_blocks < 0)
+            {
+                fprintf(stderr, "Error: Cache size must not be negative\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'W':
+            writeback_stripes = atoi(optarg);
+            if (writeback_stripes < 0)
+            {
+                fprintf(stderr, "Error: Write-back buffer size must not be negative\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'R':
+            rebuild_rate = atoi(optarg);
+            if (rebuild_rate < 0)
+            {
+                fprintf(stderr, "Error: Rebuild rate must not be negative\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 's':
+            spare_disks = atoi(optarg);
+            if (spare_disks < 0)
+            {
+                fprintf(stderr, "Error: Number of hot spares must not be negative\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'S':
+            scrub_rate = atoi(optarg);
+            if (scrub_rate < 0)
+            {
+                fprintf(stderr, "Error: Scrub rate must not be negative\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'H':
+            hedge_percentile = atof(optarg);
+            if (hedge_percentile < 0 || hedge_percentile >= 100)
+            {
+                fprintf(stderr, "Error: Hedging percentile must be at least 0 and below 100\n");
+                print_usage(argv[0]);
+            }
+            break;
+        case 'D':
+            if (disk_model_parse(optarg) != 0)
+            {
+                print_usage(argv[0]);
+            }
+            break;
         case 't':
             // we want to use the transaction file instead of the shell
             tf = fopen(optarg, "r");
@@ -318,6 +885,18 @@ int main(int argc, char **argv)
                 print_usage(argv[0]);
             }
             break;
+        case 'r':
+            replay_file = optarg;
+            break;
+        case 'o':
+            stats_file = optarg;
+            break;
+        case 'T':
+            if (trace_open(optarg) != 0)
+            {
+                print_usage(argv[0]);
+            }
+            break;
         case 'h':
         default:
             print_usage(argv[0]);
@@ -331,6 +910,13 @@ int main(int argc, char **argv)
         return -1;
     }
 
+    if (replay_file)
+    {
+        int status = replay_transactions(replay_file);
+        shut_down();
+        return status;
+    }
+
     // if we didn't use the t flag, we are in the interactive shell mode
     if (tf == stdin)
     {
@@ -344,12 +930,15 @@ int main(int argc, char **argv)
             printf("raid> ");
         }
 
+        wait_for_command(fileno(tf));
+
         char line[MAX_CMD_LENGTH];
         // read a line from tf (or standard input, if we didn't have the t flag)
-        if (!fgets(line, sizeof(line), tf))
+        int got = read_command(fileno(tf), line);
+        if (got != 1)
         {
             // if read fails
-            if (!feof(tf))
+            if (got < 0)
             {
                 // if read fails AND we are not at the end of file
                 fprintf(stderr, "Error reading command");
@@ -378,6 +967,6 @@ int main(int argc, char **argv)
         }
         cleanup_command(cmd);
     }
-    checkpoint_and_wait();
+    shut_down();
     return 0;
 }
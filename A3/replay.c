@@ -0,0 +1,353 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "raid.h"
+
+/*
+ * This file implements the replay of a transaction file. The file is
+ * mapped and each line is split into a command on the stack, so nothing
+ * is allocated per command. Consecutive wb and rb commands are gathered
+ * into a window and carried out together by access_blocks, so that the
+ * disks work on all of them at once. A command that would write a stripe
+ * the window already reads or writes, or read a stripe it writes, starts
+ * a new window, so that commands on the same stripe keep their order. Any
+ * other command is carried out on its own by execute_command once the
+ * window before it is done.
+ *
+ * Each command prints the same output as it would in the shell, in the
+ * order of the file.
+ */
+
+// Maximum length of a command line; longer lines are cut short
+#define MAX_LINE_LENGTH 256
+
+// Files whose first block is kept for wb commands, which tend to write
+// the same few files over and over
+#define PAYLOAD_FILES 64
+
+// A wb or rb command in the current window
+typedef struct {
+    int stripe_num;
+    int error;          // 0, errno from opening the file, or -1 if it is too short
+    char file[MAX_LINE_LENGTH];
+} replay_entry_t;
+
+typedef struct {
+    char name[MAX_LINE_LENGTH]; // empty if the entry is unused
+    char *data;
+} payload_t;
+
+static block_access_t *window;  // queue_depth accesses
+static replay_entry_t *entries; // the command behind each access
+static char *window_data;       // a block for each access
+static int window_count;
+
+static payload_t payloads[PAYLOAD_FILES];
+static int next_payload;
+
+/* Split line into the command cmd, in the manner of parse_command.
+ *
+ * Returns 0 on success and -1 if the line is empty.
+ */
+static int split_command(char *line, command_t *cmd)
+{
+    char *save;
+    cmd->cmd = strtok_r(line, " ", &save);
+    cmd->arg1 = strtok_r(NULL, " ", &save);
+    cmd->arg2 = strtok_r(NULL, " ", &save);
+    cmd->arg3 = strtok_r(NULL, " ", &save);
+    return cmd->cmd ? 0 : -1;
+}
+
+/* Copy the first block of the local file named filename into data,
+ * keeping it for later commands that write the same file.
+ *
+ * Returns 0 on success, errno if the file cannot be opened or read, and
+ * -1 if it is smaller than a block.
+ */
+static int load_payload(char *filename, char *data)
+{
+    for (int i = 0; i < PAYLOAD_FILES; i++)
+    {
+        if (strcmp(payloads[i].name, filename) == 0)
+        {
+            memcpy(data, payloads[i].data, block_size);
+            return 0;
+        }
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        return errno;
+    }
+    size_t bytes_read = fread(data, 1, block_size, fp);
+    int error = ferror(fp) ? EIO : 0;
+    fclose(fp);
+    if (bytes_read < (size_t)block_size)
+    {
+        return error ? error : -1;
+    }
+
+    payload_t *p = &payloads[next_payload];
+    next_payload = (next_payload + 1) % PAYLOAD_FILES;
+    strcpy(p->name, filename);
+    memcpy(p->data, data, block_size);
+    return 0;
+}
+
+/* Forget the files kept by load_payload, since a command may have
+ * changed them.
+ */
+static void forget_payloads()
+{
+    for (int i = 0; i < PAYLOAD_FILES; i++)
+    {
+        payloads[i].name[0] = '\0';
+    }
+}
+
+/* Carry out the commands in the window, and print their output in order.
+ */
+static void run_window()
+{
+    if (window_count == 0)
+    {
+        return;
+    }
+
+    // a wb whose file could not be read takes no part
+    block_access_t batch[window_count];
+    int n = 0;
+    for (int i = 0; i < window_count; i++)
+    {
+        if (entries[i].error == 0)
+        {
+            batch[n++] = window[i];
+        }
+    }
+    access_blocks(batch, n);
+
+    n = 0;
+    for (int i = 0; i < window_count; i++)
+    {
+        block_access_t *a = &window[i];
+        if (!a->write)
+        {
+            a->status = batch[n++].status;
+            if (a->status != 0)
+            {
+                fprintf(stderr, "Failed to read data from disk");
+                fprintf(stderr, "Failed to read block from RAID");
+            }
+            else if (fwrite(a->data, 1, block_size, stdout) != (size_t)block_size)
+            {
+                fprintf(stderr, "Failed to write block to stdout");
+            }
+            else
+            {
+                fprintf(stderr, "Block %d printed\n", a->block_num);
+            }
+            continue;
+        }
+
+        printf("wb\n");
+        if (entries[i].error > 0)
+        {
+            fprintf(stderr, "Error opening %s: %s\n", entries[i].file, strerror(entries[i].error));
+            continue;
+        }
+        if (entries[i].error < 0)
+        {
+            fprintf(stderr, "Error: File is smaller than block size\n");
+            continue;
+        }
+        a->status = batch[n++].status;
+        if (a->status != 0)
+        {
+            fprintf(stderr, "Failed to write block to RAID");
+        }
+        else
+        {
+            fprintf(stderr, "Block %d written to RAID\n", a->block_num);
+        }
+    }
+    window_count = 0;
+
+    // a disk process forked later must not inherit output still buffered
+    fflush(stdout);
+}
+
+/* Add the wb or rb command cmd to the window, first carrying out the
+ * window if it is full or cmd must wait for a command in it.
+ */
+static void add_to_window(command_t *cmd)
+{
+    int write = strcmp(cmd->cmd, "wb") == 0;
+    int block_num = atoi(cmd->arg1);
+    int stripe_num = block_num / num_disks;
+
+    int conflict = window_count == queue_depth;
+    for (int i = 0; i < window_count && !conflict; i++)
+    {
+        conflict = entries[i].stripe_num == stripe_num && (write || window[i].write);
+    }
+    if (conflict)
+    {
+        run_window();
+    }
+
+    block_access_t *a = &window[window_count];
+    replay_entry_t *e = &entries[window_count];
+    a->block_num = block_num;
+    a->write = write;
+    a->data = &window_data[(size_t)window_count * block_size];
+    e->stripe_num = stripe_num;
+    e->error = 0;
+    if (write)
+    {
+        strcpy(e->file, cmd->arg2);
+        e->error = load_payload(cmd->arg2, a->data);
+    }
+    window_count++;
+}
+
+/* Unmap the size bytes of the transactions file at text, and free the
+ * window and payload buffers of a replay, as far as they were allocated.
+ */
+static void free_replay(char *text, size_t size)
+{
+    if (size > 0)
+    {
+        munmap(text, size);
+    }
+    for (int i = 0; i < PAYLOAD_FILES; i++)
+    {
+        free(payloads[i].data);
+        payloads[i].data = NULL;
+    }
+    free(window);
+    free(entries);
+    free(window_data);
+    window = NULL;
+    entries = NULL;
+    window_data = NULL;
+}
+
+/* Replay the transaction file named filename against the RAID system,
+ * overlapping the commands that work on different stripes. The
+ * controller does its background work between windows of commands.
+ *
+ * Returns 0 on success and -1 if the file cannot be read.
+ */
+int replay_transactions(char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror("Failed to open transactions file");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    char *text = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (text == MAP_FAILED)
+    {
+        perror("Failed to map transactions file");
+        return -1;
+    }
+    if (size > 0)
+    {
+        madvise(text, size, MADV_SEQUENTIAL);
+    }
+
+    window = malloc(queue_depth * sizeof(*window));
+    entries = malloc(queue_depth * sizeof(*entries));
+    window_data = malloc((size_t)queue_depth * block_size);
+    int ok = window && entries && window_data;
+    for (int i = 0; i < PAYLOAD_FILES && ok; i++)
+    {
+        payloads[i].name[0] = '\0';
+        payloads[i].data = malloc(block_size);
+        ok = payloads[i].data != NULL;
+    }
+    if (!ok)
+    {
+        perror("Failed to allocate replay window");
+        free_replay(text, size);
+        return -1;
+    }
+
+    char *next = text;
+    char *end = text + size;
+    while (next < end)
+    {
+        char *newline = memchr(next, '\n', end - next);
+        size_t length = (newline ? newline : end) - next;
+        char line[MAX_LINE_LENGTH];
+        if (length >= sizeof(line))
+        {
+            length = sizeof(line) - 1;
+        }
+        memcpy(line, next, length);
+        line[length] = '\0';
+        next = newline ? newline + 1 : end;
+
+        command_t cmd;
+        if (split_command(line, &cmd) != 0)
+        {
+            run_window();
+            fprintf(stderr, "Failed to parse command\n");
+            continue;
+        }
+
+        if (((strcmp(cmd.cmd, "wb") == 0 && cmd.arg2) || strcmp(cmd.cmd, "rb") == 0) &&
+            cmd.arg1 && atoi(cmd.arg1) >= 0 && atoi(cmd.arg1) < (disk_size / block_size) * num_disks)
+        {
+            add_to_window(&cmd);
+            if (window_count == 1)
+            {
+                controller_idle();
+            }
+            continue;
+        }
+
+        // anything else, including a wb or rb that is certain to fail,
+        // runs on its own, in order with the rest
+        run_window();
+        controller_idle();
+        if (execute_command(&cmd) == -1)
+        {
+            fprintf(stderr, "Command execution failed\n");
+        }
+        fflush(stdout);
+        forget_payloads();
+    }
+    run_window();
+
+    free_replay(text, size);
+    return 0;
+}
@@ -0,0 +1,238 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "raid.h"
+
+/*
+ * This file keeps the controller's statistics: for every disk, the reads
+ * and writes sent to it, and for the whole array, the operations of
+ * stats_op_t. Each is counted, with the bytes it moved, in a latency
+ * histogram.
+ *
+ * The histograms are log-linear, in the manner of HdrHistogram: every
+ * power of two of nanoseconds is split into HIST_SUB equal buckets, so a
+ * latency is known to within 1 part in HIST_SUB whatever its size, and
+ * recording one is a few instructions.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+// Values below HIST_SUB have a bucket each; each power of two above has
+// HIST_SUB of them, up to the largest 64-bit value
+#define HIST_BUCKETS (HIST_SUB + (64 - HIST_SUB_BITS) * HIST_SUB)
+
+typedef struct {
+    unsigned long count;
+    unsigned long bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    unsigned long buckets[HIST_BUCKETS];
+} histogram_t;
+
+// Reads a disk must have served before its latencies are used for the
+// hedging deadline
+#define DEADLINE_MIN_READS 32
+
+static const char *op_names[NUM_STATS_OPS] = {"Reads", "Full-stripe writes", "Parity updates", "Rebuilds"};
+static const trace_op_t op_traces[NUM_STATS_OPS] = {TRACE_ARRAY_READ, TRACE_FULL_STRIPE,
+                                                    TRACE_PARITY_UPDATE, TRACE_REBUILD};
+
+static histogram_t *disk_histograms; // a read and a write histogram for each disk
+static int disk_count;
+static histogram_t op_histograms[NUM_STATS_OPS];
+
+/* Return the bucket that holds latencies of value nanoseconds.
+ */
+static int bucket_of(uint64_t value)
+{
+    if (value < HIST_SUB)
+    {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return HIST_SUB + shift * HIST_SUB + (int)(value >> shift) - HIST_SUB;
+}
+
+/* Return the largest latency that falls into bucket b.
+ */
+static uint64_t bucket_top(int b)
+{
+    if (b < HIST_SUB)
+    {
+        return b;
+    }
+    int shift = (b - HIST_SUB) / HIST_SUB;
+    uint64_t low = (uint64_t)((b - HIST_SUB) % HIST_SUB + HIST_SUB) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+/* Add a latency of ns nanoseconds for an operation that moved bytes
+ * bytes to h.
+ */
+static void record(histogram_t *h, long bytes, uint64_t ns)
+{
+    h->count++;
+    h->bytes += bytes;
+    h->total_ns += ns;
+    if (ns > h->max_ns)
+    {
+        h->max_ns = ns;
+    }
+    h->buckets[bucket_of(ns)]++;
+}
+
+/* Return the latency in nanoseconds below which fraction of those in h
+ * fall, to within the width of its bucket.
+ */
+static uint64_t percentile(histogram_t *h, double fraction)
+{
+    unsigned long rank = (unsigned long)(fraction * h->count + 0.999999);
+    unsigned long seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += h->buckets[b];
+        if (seen >= rank && seen > 0)
+        {
+            uint64_t top = bucket_top(b);
+            return top < h->max_ns ? top : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+/* Print one line for h, named name, to fp.
+ */
+static void print_histogram(FILE *fp, const char *name, histogram_t *h)
+{
+    fprintf(fp, "%s: %lu (%.1f MB)", name, h->count, h->bytes / 1e6);
+    if (h->count > 0)
+    {
+        fprintf(fp, ", mean %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us",
+                h->total_ns / 1e3 / h->count, percentile(h, 0.5) / 1e3, percentile(h, 0.99) / 1e3,
+                percentile(h, 0.999) / 1e3, h->max_ns / 1e3);
+    }
+    fprintf(fp, "\n");
+}
+
+/* Set up the statistics for total_disks disks.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int stats_init(int total_disks)
+{
+    disk_histograms = calloc(2 * total_disks, sizeof(*disk_histograms));
+    if (!disk_histograms)
+    {
+        return -1;
+    }
+    disk_count = total_disks;
+    return 0;
+}
+
+/* Return the time in nanoseconds on a clock that only goes forward.
+ */
+uint64_t stats_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Count a request cmd, a CMD_READ, CMD_WRITE or CMD_XOR_WRITE of a
+ * block, that disk_num took ns nanoseconds to complete. An XOR write is
+ * counted as a write.
+ */
+void stats_disk(int disk_num, disk_command_t cmd, uint64_t ns)
+{
+    if (disk_histograms && disk_num < disk_count)
+    {
+        record(&disk_histograms[2 * disk_num + (cmd != CMD_READ)], block_size, ns);
+    }
+}
+
+/* Count an operation op of the controller that moved bytes bytes and
+ * took ns nanoseconds, which has just finished, and trace it.
+ */
+void stats_op(stats_op_t op, long bytes, uint64_t ns)
+{
+    record(&op_histograms[op], bytes, ns);
+    if (tracing())
+    {
+        trace_event(op_traces[op], -1, -1, stats_now() - ns);
+    }
+}
+
+/* Return the read latency in nanoseconds below which percent percent of
+ * the reads of the fastest disk fall, so that one slow disk does not
+ * raise it, or 0 if no disk has served enough reads to tell.
+ */
+uint64_t stats_read_deadline(double percent)
+{
+    uint64_t deadline = 0;
+    for (int i = 0; i < disk_count; i++)
+    {
+        histogram_t *h = &disk_histograms[2 * i];
+        if (h->count >= DEADLINE_MIN_READS)
+        {
+            uint64_t latency = percentile(h, percent / 100);
+            if (deadline == 0 || latency < deadline)
+            {
+                deadline = latency;
+            }
+        }
+    }
+    return deadline;
+}
+
+/* Print every disk's and operation's counts and latencies to fp.
+ */
+void stats_print(FILE *fp)
+{
+    for (int i = 0; i < disk_count; i++)
+    {
+        char name[MAX_NAME];
+        snprintf(name, sizeof(name), "Disk %d reads", i);
+        print_histogram(fp, name, &disk_histograms[2 * i]);
+        snprintf(name, sizeof(name), "Disk %d writes", i);
+        print_histogram(fp, name, &disk_histograms[2 * i + 1]);
+    }
+    for (int op = 0; op < NUM_STATS_OPS; op++)
+    {
+        print_histogram(fp, op_names[op], &op_histograms[op]);
+    }
+}
+
+/* Write the statistics, as printed by stats_print, to the file named
+ * filename.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int stats_dump(char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+    {
+        perror("Failed to open statistics file");
+        return -1;
+    }
+    stats_print(fp);
+    if (fclose(fp) != 0)
+    {
+        perror("Failed to write statistics file");
+        return -1;
+    }
+    return 0;
+}
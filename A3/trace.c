@@ -0,0 +1,138 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "raid.h"
+
+/*
+ * This file records the binary trace of a process: the controller or a
+ * disk. Each process has a ring of TRACE_EVENTS fixed-size events in its
+ * own file, named after the trace prefix and its pid, which is mapped
+ * into memory. Recording an event is a store into the mapping, and the
+ * events reach the file even if the process is killed. When the ring is
+ * full, the oldest events are overwritten. trace_decode merges the files
+ * into one timeline.
+ */
+
+static char *prefix;             // NULL while tracing is off
+static trace_header_t *header;   // the mapped file, followed by its events
+static trace_event_t *events;
+
+/* Create this process's trace file and map it. controller is 1 in the
+ * controller and 0 in a disk process.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int map_ring(int controller)
+{
+    char name[MAX_NAME * 8];
+    snprintf(name, sizeof(name), "%s.%d", prefix, (int)getpid());
+
+    size_t size = sizeof(trace_header_t) + (size_t)TRACE_EVENTS * sizeof(trace_event_t);
+    int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0)
+    {
+        perror("Failed to create trace file");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+    {
+        perror("Failed to map trace file");
+        return -1;
+    }
+
+    header = ring;
+    header->magic = TRACE_MAGIC;
+    header->capacity = TRACE_EVENTS;
+    header->pid = getpid();
+    header->controller = controller;
+    header->next = 0;
+    events = (trace_event_t *)(header + 1);
+    return 0;
+}
+
+/* Start tracing this process, and the disk processes it forks later, to
+ * files named name_prefix followed by the pid.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int trace_open(char *name_prefix)
+{
+    prefix = name_prefix;
+    if (map_ring(1) != 0)
+    {
+        prefix = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Give a newly forked process a trace file of its own, in place of the
+ * one it shares with its parent.
+ */
+void trace_forked()
+{
+    if (!prefix)
+    {
+        return;
+    }
+
+    munmap(header, sizeof(trace_header_t) + (size_t)TRACE_EVENTS * sizeof(trace_event_t));
+    header = NULL;
+    if (map_ring(0) != 0)
+    {
+        prefix = NULL;
+    }
+}
+
+/* Return 1 if this process is being traced.
+ */
+int tracing()
+{
+    return header != NULL;
+}
+
+/* Record that operation op, on stripe_num of disk_num (-1 for none),
+ * started at start, as returned by stats_now, and has just finished. A
+ * start of 0 records an instant event. Processes that are not traced
+ * record nothing.
+ */
+void trace_event(trace_op_t op, int disk_num, int stripe_num, uint64_t start)
+{
+    if (!header)
+    {
+        return;
+    }
+
+    uint64_t now = stats_now();
+    uint64_t ns = start > 0 ? now - start : 0;
+    trace_event_t *e = &events[header->next & (TRACE_EVENTS - 1)];
+    e->time = start > 0 ? start : now;
+    e->duration = ns > UINT32_MAX ? UINT32_MAX : ns;
+    e->stripe = stripe_num;
+    e->disk = disk_num;
+    e->op = op;
+    // the event is complete before it is counted
+    __atomic_store_n(&header->next, header->next + 1, __ATOMIC_RELEASE);
+}
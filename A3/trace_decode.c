@@ -0,0 +1,155 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raid.h"
+
+/*
+ * This file implements trace_decode, which reads the trace files written
+ * by raid_sim -T, from the controller and from every disk process, and
+ * prints all of their events as one timeline, ordered by the time each
+ * event began. Times are in seconds from the first event.
+ */
+
+static const char *op_names[NUM_TRACE_OPS] = {
+    "read", "write", "checkpoint", "array read", "full stripe", "parity update",
+    "rebuild", "fail", "restore", "xor write",
+};
+
+// An event together with the process that recorded it
+typedef struct {
+    trace_event_t event;
+    int pid;
+    int controller;
+} timeline_entry_t;
+
+/* Compare two timeline entries by start time for qsort.
+ */
+static int compare_time(const void *a, const void *b)
+{
+    uint64_t x = ((const timeline_entry_t *)a)->event.time;
+    uint64_t y = ((const timeline_entry_t *)b)->event.time;
+    return (x > y) - (x < y);
+}
+
+/* Append the events kept in the trace file named filename to the
+ * timeline, which holds *count entries in space for *capacity, growing
+ * it as needed.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int read_trace(char *filename, timeline_entry_t **timeline, size_t *count, size_t *capacity)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != TRACE_MAGIC ||
+        header.capacity == 0 || (header.capacity & (header.capacity - 1)) != 0)
+    {
+        fprintf(stderr, "%s: not a trace file\n", filename);
+        fclose(fp);
+        return -1;
+    }
+
+    trace_event_t *ring = malloc((size_t)header.capacity * sizeof(*ring));
+    if (!ring || fread(ring, sizeof(*ring), header.capacity, fp) != header.capacity)
+    {
+        fprintf(stderr, "%s: trace file is truncated\n", filename);
+        free(ring);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    // once the ring has wrapped, only the last capacity events are left
+    uint64_t first = header.next > header.capacity ? header.next - header.capacity : 0;
+    if (*count + (header.next - first) > *capacity)
+    {
+        *capacity = 2 * (*count + (header.next - first));
+        timeline_entry_t *grown = realloc(*timeline, *capacity * sizeof(**timeline));
+        if (!grown)
+        {
+            perror("Failed to allocate the timeline");
+            free(ring);
+            return -1;
+        }
+        *timeline = grown;
+    }
+
+    for (uint64_t i = first; i < header.next; i++)
+    {
+        timeline_entry_t *entry = &(*timeline)[(*count)++];
+        entry->event = ring[i & (header.capacity - 1)];
+        entry->pid = header.pid;
+        entry->controller = header.controller;
+    }
+    free(ring);
+    return 0;
+}
+
+/* The main entry point for trace_decode.
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s trace_file ...\n", argv[0]);
+        return 1;
+    }
+
+    timeline_entry_t *timeline = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (read_trace(argv[i], &timeline, &count, &capacity) != 0)
+        {
+            free(timeline);
+            return 1;
+        }
+    }
+    qsort(timeline, count, sizeof(*timeline), compare_time);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        trace_event_t *e = &timeline[i].event;
+        char process[MAX_NAME];
+        snprintf(process, sizeof(process), "%s %d", timeline[i].controller ? "controller" : "disk",
+                 timeline[i].pid);
+
+        printf("%14.9f  %-16s %-14s", (e->time - timeline[0].event.time) / 1e9, process,
+               e->op < NUM_TRACE_OPS ? op_names[e->op] : "unknown");
+        if (e->disk >= 0)
+        {
+            printf("  disk %d", e->disk);
+        }
+        if (e->stripe >= 0)
+        {
+            printf("  stripe %d", e->stripe);
+        }
+        if (e->duration > 0)
+        {
+            printf("  %.1f us", e->duration / 1e3);
+        }
+        printf("\n");
+    }
+
+    free(timeline);
+    return 0;
+}